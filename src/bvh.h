@@ -0,0 +1,589 @@
+#pragma once
+
+#include <cmath>
+#include <span>
+#include <vector>
+#include <limits>
+#include <bit>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <numeric>
+#include <algorithm>
+
+#include "types.h"
+#include "parallel.h"
+#include "ray_packet.h"
+
+inline vec3f vmin(const vec3f& a, const vec3f& b) {
+    return vec3f(std::min(a.x, b.x), std::min(a.y, b.y), std::min(a.z, b.z));
+}
+
+inline vec3f vmax(const vec3f& a, const vec3f& b) {
+    return vec3f(std::max(a.x, b.x), std::max(a.y, b.y), std::max(a.z, b.z));
+}
+
+struct AABB {
+    vec3f min = vec3f( std::numeric_limits<float>::max(),  std::numeric_limits<float>::max(),  std::numeric_limits<float>::max());
+    vec3f max = vec3f(-std::numeric_limits<float>::max(), -std::numeric_limits<float>::max(), -std::numeric_limits<float>::max());
+
+    inline void grow(const vec3f& p) { min = vmin(min, p); max = vmax(max, p); }
+    inline void grow(const AABB& b) { min = vmin(min, b.min); max = vmax(max, b.max); }
+    inline bool empty() const { return min.x > max.x; }
+    inline vec3f centroid() const { return (min + max) * .5f; }
+
+    inline float area() const {
+        if (empty()) return 0;
+        vec3f e = max - min;
+        return e.x*e.y + e.y*e.z + e.z*e.x;
+    }
+
+    // slab test, returns the entry distance or +inf on a miss
+    inline float intersect(const vec3f& origin, const vec3f& inv_dir, const float t_max) const {
+        float tx1 = (min.x - origin.x) * inv_dir.x, tx2 = (max.x - origin.x) * inv_dir.x;
+        float tmin = std::min(tx1, tx2), tmax = std::max(tx1, tx2);
+        float ty1 = (min.y - origin.y) * inv_dir.y, ty2 = (max.y - origin.y) * inv_dir.y;
+        tmin = std::max(tmin, std::min(ty1, ty2)); tmax = std::min(tmax, std::max(ty1, ty2));
+        float tz1 = (min.z - origin.z) * inv_dir.z, tz2 = (max.z - origin.z) * inv_dir.z;
+        tmin = std::max(tmin, std::min(tz1, tz2)); tmax = std::min(tmax, std::max(tz1, tz2));
+        return (tmax >= tmin && tmax > 0 && tmin < t_max) ? tmin : std::numeric_limits<float>::infinity();
+    }
+};
+
+struct BVHNode {
+    AABB bounds;
+    uint32_t left_first; // index of the left child (right child follows it), or first primitive for leaves
+    uint32_t count;      // number of primitives, 0 for interior nodes
+
+    inline bool is_leaf() const { return count > 0; }
+};
+
+// binary bvh over arbitrary primitives, built from their bounding boxes with a binned SAH
+struct BVH {
+    static constexpr int BINS = 16;
+    static constexpr int MAX_DEPTH = 64;
+    static constexpr uint32_t MAX_LEAF_SIZE = 8;
+    static constexpr float TRAVERSAL_COST = 1.f; // relative to one primitive test
+
+    // what the traversal reads, views of the stores below after a build or of arrays kept elsewhere, such as a
+    // mapped cache, after view()
+    std::span<const BVHNode> nodes = {};
+    std::span<const uint32_t> prim_indices = {};
+    // back the views when built here, the primitive indices may still be rewritten in place after the build
+    std::vector<BVHNode> node_store = {};
+    std::vector<uint32_t> prim_store = {};
+
+    enum class BuildMode { SAH, LBVH };
+
+    BuildMode mode = BuildMode::SAH;       // LBVH trades tree quality for a much faster build
+    unsigned threads = thread_count;       // upper bound on threads used by build()
+    uint32_t leaf_width = 1;               // primitives tested at once in a leaf, the SAH costs leaves per group of them
+
+    // the views point into the stores, which keep their arrays when moved but not when copied
+    BVH() = default;
+    BVH(const BVH&) = delete;
+    BVH& operator=(const BVH&) = delete;
+    BVH(BVH&&) = default;
+    BVH& operator=(BVH&&) = default;
+
+    void build(const std::vector<AABB>& prim_bounds) {
+        const uint32_t n = prim_bounds.size();
+        clear();
+        prim_store.resize(n);
+        std::iota(prim_store.begin(), prim_store.end(), 0);
+        if (n == 0) return;
+
+        centroids.resize(n);
+        std::vector<AABB> partial_bounds(threads), partial_centroids(threads);
+        const size_t chunks = parallel_chunks(n, n > PARALLEL_THRESHOLD ? threads : 1, [&](size_t c, size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                centroids[i] = prim_bounds[i].centroid();
+                partial_bounds[c].grow(prim_bounds[i]);
+                partial_centroids[c].grow(centroids[i]);
+            }
+        });
+
+        node_store.resize(2*n - 1);
+        std::atomic<uint32_t> node_count = 1;
+        node_store[0].left_first = 0;
+        node_store[0].count = n;
+        node_store[0].bounds = AABB();
+        for (size_t c = 0; c < chunks; ++c) node_store[0].bounds.grow(partial_bounds[c]);
+
+        if (mode == BuildMode::LBVH) {
+            AABB centroid_bounds;
+            for (size_t c = 0; c < chunks; ++c) centroid_bounds.grow(partial_centroids[c]);
+            std::vector<uint64_t> codes = morton_codes(centroid_bounds);
+            radix_sort(codes);
+            emit_lbvh(0, prim_bounds, codes, node_count, 0, threads);
+        } else {
+            subdivide(0, prim_bounds, node_count, 0, threads);
+        }
+
+        node_store.resize(node_count);
+        node_store.shrink_to_fit();
+        nodes = node_store;
+        prim_indices = prim_store;
+        centroids = {};
+    }
+
+    // uses arrays kept elsewhere in place, they have to outlive the bvh
+    void view(const std::span<const BVHNode> n, const std::span<const uint32_t> p) {
+        clear();
+        nodes = n;
+        prim_indices = p;
+    }
+
+    void clear() {
+        nodes = {};
+        prim_indices = {};
+        node_store = {};
+        prim_store = {};
+    }
+
+    // whether the traversal can walk the views without leaving them, for views of arrays that weren't built here:
+    // children come after their parent and within the nodes, the tree is shallow enough for the traversal stacks,
+    // leaves cover ranges of prim_indices and those index fewer than prim_count primitives
+    bool valid(const uint32_t prim_count) const {
+        for (const uint32_t p : prim_indices) if (p >= prim_count) return false;
+        std::vector<uint8_t> depth(nodes.size());
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            const BVHNode& node = nodes[i];
+            if (node.is_leaf()) {
+                if (uint64_t(node.left_first) + node.count > prim_indices.size()) return false;
+                continue;
+            }
+            if (node.left_first <= i || uint64_t(node.left_first) + 1 >= nodes.size() || depth[i] + 1 >= MAX_DEPTH)
+                return false;
+            for (const uint32_t c : {node.left_first, node.left_first + 1}) depth[c] = std::max<uint8_t>(depth[c], depth[i] + 1);
+        }
+        return true;
+    }
+
+    inline size_t memory_bytes() const {
+        return nodes.size() * sizeof(BVHNode) + prim_indices.size() * sizeof(uint32_t);
+    }
+
+    // closest hit: intersect_prim(prim, t_max) is called for candidate primitives,
+    // returns true on a hit and shrinks t_max to the hit distance
+    template <typename F>
+    bool intersect(const vec3f& origin, const vec3f& direction, float& t_max, F&& intersect_prim) const {
+        return traverse<false>(origin, direction, t_max, [&](const uint32_t first, const uint32_t count, float& t) {
+            bool hit = false;
+            for (uint32_t i = 0; i < count; ++i) hit |= intersect_prim(prim_indices[first + i], t);
+            return hit;
+        });
+    }
+
+    // any hit: stops at the first primitive for which occluded_prim(prim, t_max) returns true
+    template <typename F>
+    bool occluded(const vec3f& origin, const vec3f& direction, float t_max, F&& occluded_prim) const {
+        return traverse<true>(origin, direction, t_max, [&](const uint32_t first, const uint32_t count, float t) {
+            for (uint32_t i = 0; i < count; ++i) if (occluded_prim(prim_indices[first + i], t)) return true;
+            return false;
+        });
+    }
+
+    // same as intersect and occluded, with whole leaves handed over at once as intersect_leaf(first, count, t_max):
+    // the range of prim_indices they cover, for primitives stored in that order and tested several at a time
+    template <typename F>
+    bool intersect_leaves(const vec3f& origin, const vec3f& direction, float& t_max, F&& intersect_leaf) const {
+        return traverse<false>(origin, direction, t_max, intersect_leaf);
+    }
+
+    template <typename F>
+    bool occluded_leaves(const vec3f& origin, const vec3f& direction, float t_max, F&& occluded_leaf) const {
+        return traverse<true>(origin, direction, t_max, occluded_leaf);
+    }
+
+    // f(first, count) for every leaf
+    template <typename F>
+    void for_each_leaf(F&& f) const {
+        for (const BVHNode& node : nodes) if (node.is_leaf()) f(node.left_first, node.count);
+    }
+
+    // the active lanes of a packet traced together: a node is skipped when it lies outside the packet's frustum,
+    // otherwise it is tested against all the lanes at once and passed on with those that reached and hit it. a
+    // subtree reached by a single lane is finished by the single ray traversal.
+    // intersect_leaf(first, count, lanes) tests the lanes' rays against a leaf, shrinking t_max[lane] on closer
+    // hits, and returns the lanes it hit. returns the lanes hit anywhere
+    template <typename F>
+    uint32_t intersect_packet(const RayPacket& packet, const uint32_t active, float* t_max, F&& intersect_leaf) const {
+        return traverse_packet<false>(packet, active, t_max, intersect_leaf);
+    }
+
+    // lanes with anything closer than their t_max, occluded_leaf(first, count, lanes) returns those it finds
+    // occluded, which then stop traversing
+    template <typename F>
+    uint32_t occluded_packet(const RayPacket& packet, const uint32_t active, const float* t_max, F&& occluded_leaf) const {
+        float t[RayPacket::N];
+        std::copy(t_max, t_max + RayPacket::N, t);
+        return traverse_packet<true>(packet, active, t, occluded_leaf);
+    }
+
+private:
+    template <bool ANY_HIT, typename F>
+    bool traverse(const vec3f& origin, const vec3f& direction, float& t_max, F&& intersect_leaf, const uint32_t root = 0) const {
+        if (nodes.empty()) return false;
+
+        const vec3f inv_dir(1.f/direction.x, 1.f/direction.y, 1.f/direction.z);
+        if (nodes[root].bounds.intersect(origin, inv_dir, t_max) == std::numeric_limits<float>::infinity()) return false;
+
+        uint32_t stack[MAX_DEPTH];
+        int stack_size = 0;
+        uint32_t idx = root;
+        bool hit = false;
+
+        while (true) {
+            const BVHNode& node = nodes[idx];
+            if (node.is_leaf()) {
+                if (intersect_leaf(node.left_first, node.count, t_max)) {
+                    if constexpr (ANY_HIT) return true;
+                    hit = true;
+                }
+                if (stack_size == 0) break;
+                idx = stack[--stack_size];
+                continue;
+            }
+
+            uint32_t near = node.left_first, far = node.left_first + 1;
+            float d_near = nodes[near].bounds.intersect(origin, inv_dir, t_max);
+            float d_far  = nodes[far].bounds.intersect(origin, inv_dir, t_max);
+            if (d_near > d_far) { std::swap(near, far); std::swap(d_near, d_far); }
+
+            if (d_near == std::numeric_limits<float>::infinity()) {
+                if (stack_size == 0) break;
+                idx = stack[--stack_size];
+            } else {
+                idx = near;
+                if (d_far != std::numeric_limits<float>::infinity()) stack[stack_size++] = far;
+            }
+        }
+
+        return hit;
+    }
+
+    template <bool ANY_HIT, typename F>
+    uint32_t traverse_packet(const RayPacket& packet, const uint32_t active, float* t_max, F&& intersect_leaf) const {
+        if (nodes.empty() || !active) return 0;
+        const Frustum frustum(packet, active);
+
+        struct Entry {
+            uint32_t idx;
+            uint32_t lanes;
+        };
+        Entry stack[MAX_DEPTH + 1];
+        int stack_size = 0;
+        stack[stack_size++] = {0, active};
+        uint32_t hit = 0;
+
+        while (stack_size) {
+            const Entry e = stack[--stack_size];
+            // occluded lanes are done
+            const uint32_t lanes = ANY_HIT ? e.lanes & ~hit : e.lanes;
+            if (!lanes) continue;
+
+            if (std::has_single_bit(lanes)) {
+                const int lane = std::countr_zero(lanes);
+                auto single_leaf = [&](const uint32_t first, const uint32_t count, float&) {
+                    return intersect_leaf(first, count, lanes) != 0;
+                };
+                if (traverse<ANY_HIT>(packet.origin(lane), packet.direction(lane), t_max[lane], single_leaf, e.idx)) hit |= lanes;
+                continue;
+            }
+
+            const BVHNode& node = nodes[e.idx];
+            if (frustum.outside(node.bounds.min, node.bounds.max)) continue;
+            float t_near[RayPacket::N];
+            const uint32_t reached = packet.intersect(node.bounds.min, node.bounds.max, t_max, t_near) & lanes;
+            if (!reached) continue;
+
+            if (node.is_leaf()) {
+                hit |= intersect_leaf(node.left_first, node.count, reached);
+                continue;
+            }
+            // the children are tested when popped, the one closer along the first lane's ray goes first
+            const int lane = std::countr_zero(reached);
+            const bool left_first = packet.direction(lane) * (nodes[node.left_first + 1].bounds.centroid() - nodes[node.left_first].bounds.centroid()) > 0;
+            stack[stack_size++] = {node.left_first + (left_first ? 1 : 0), reached};
+            stack[stack_size++] = {node.left_first + (left_first ? 0 : 1), reached};
+        }
+        return hit;
+    }
+
+    // nodes with fewer primitives than this are binned and built on a single thread
+    static constexpr uint32_t PARALLEL_THRESHOLD = 1 << 14;
+    static constexpr uint32_t LBVH_LEAF_SIZE = 4;
+
+    struct Bins {
+        AABB bounds[3][BINS];
+        uint32_t count[3][BINS] = {};
+    };
+
+    std::vector<vec3f> centroids = {};
+
+    inline float leaf_tests(const uint32_t count) const {
+        return float((count + leaf_width - 1) / leaf_width);
+    }
+
+    inline int bin_index(const vec3f& centroid, const int axis, const AABB& centroid_bounds, const float scale) const {
+        return std::min(BINS - 1, int((centroid[axis] - centroid_bounds.min[axis]) * scale));
+    }
+
+    // finds the cheapest binned split plane, returns its cost (inf if the centroids can't be separated)
+    // and the bounds of both sides of the split
+    float find_split(const BVHNode& node, const std::vector<AABB>& prim_bounds, const unsigned task_threads,
+    int& best_axis, int& best_bin, AABB& centroid_bounds, AABB& best_left, AABB& best_right) const {
+        const unsigned chunks = node.count > PARALLEL_THRESHOLD ? task_threads : 1;
+        const uint32_t* prims = prim_store.data() + node.left_first;
+
+        std::vector<AABB> partial_centroids(chunks);
+        const size_t used = parallel_chunks(node.count, chunks, [&](size_t c, size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) partial_centroids[c].grow(centroids[prims[i]]);
+        });
+        centroid_bounds = AABB();
+        for (size_t c = 0; c < used; ++c) centroid_bounds.grow(partial_centroids[c]);
+
+        float scale[3];
+        for (int axis = 0; axis < 3; ++axis) {
+            const float extent = centroid_bounds.max[axis] - centroid_bounds.min[axis];
+            scale[axis] = extent > 0 ? BINS / extent : 0;
+        }
+
+        std::vector<Bins> partial_bins(used);
+        parallel_chunks(node.count, used, [&](size_t c, size_t begin, size_t end) {
+            Bins& bins = partial_bins[c];
+            for (size_t i = begin; i < end; ++i) {
+                const uint32_t prim = prims[i];
+                for (int axis = 0; axis < 3; ++axis) {
+                    const int b = bin_index(centroids[prim], axis, centroid_bounds, scale[axis]);
+                    bins.count[axis][b]++;
+                    bins.bounds[axis][b].grow(prim_bounds[prim]);
+                }
+            }
+        });
+        Bins& bins = partial_bins[0];
+        for (size_t c = 1; c < used; ++c) {
+            for (int axis = 0; axis < 3; ++axis) {
+                for (int b = 0; b < BINS; ++b) {
+                    bins.count[axis][b] += partial_bins[c].count[axis][b];
+                    bins.bounds[axis][b].grow(partial_bins[c].bounds[axis][b]);
+                }
+            }
+        }
+
+        float best_cost = std::numeric_limits<float>::infinity();
+        for (int axis = 0; axis < 3; ++axis) {
+            if (scale[axis] == 0) continue;
+
+            // sweep from both sides to get the boxes and counts on each side of every plane
+            AABB left_box[BINS - 1], right_box[BINS - 1];
+            uint32_t left_count[BINS - 1], right_count[BINS - 1];
+            AABB left_sweep, right_sweep;
+            uint32_t left_sum = 0, right_sum = 0;
+            for (int i = 0; i < BINS - 1; ++i) {
+                left_sum += bins.count[axis][i];
+                left_count[i] = left_sum;
+                left_sweep.grow(bins.bounds[axis][i]);
+                left_box[i] = left_sweep;
+
+                right_sum += bins.count[axis][BINS - 1 - i];
+                right_count[BINS - 2 - i] = right_sum;
+                right_sweep.grow(bins.bounds[axis][BINS - 1 - i]);
+                right_box[BINS - 2 - i] = right_sweep;
+            }
+
+            for (int i = 0; i < BINS - 1; ++i) {
+                const float cost = leaf_tests(left_count[i])*left_box[i].area() + leaf_tests(right_count[i])*right_box[i].area();
+                if (left_count[i] && right_count[i] && cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_bin = i;
+                    best_left = left_box[i];
+                    best_right = right_box[i];
+                }
+            }
+        }
+        return best_cost;
+    }
+
+    // task_threads is the number of threads this subtree may occupy, it is halved at every parallel split
+    void subdivide(const uint32_t idx, const std::vector<AABB>& prim_bounds, std::atomic<uint32_t>& node_count, const int depth,
+    const unsigned task_threads) {
+        BVHNode& node = node_store[idx];
+        if (node.count <= 1 || depth >= MAX_DEPTH - 1) return;
+
+        int axis = 0, bin = 0;
+        AABB centroid_bounds, left_bounds, right_bounds;
+        const float split_cost = find_split(node, prim_bounds, task_threads, axis, bin, centroid_bounds, left_bounds, right_bounds)
+            + TRAVERSAL_COST * node.bounds.area();
+        const float leaf_cost = leaf_tests(node.count) * node.bounds.area();
+        if (split_cost >= leaf_cost && node.count <= MAX_LEAF_SIZE) return;
+
+        uint32_t left_count = node.count / 2;
+        if (split_cost == std::numeric_limits<float>::infinity()) {
+            // every centroid coincides, halve the range to keep leaves small
+            left_bounds = right_bounds = AABB();
+            for (uint32_t i = 0; i < node.count; ++i)
+                (i < left_count ? left_bounds : right_bounds).grow(prim_bounds[prim_store[node.left_first + i]]);
+        } else {
+            const float scale = BINS / (centroid_bounds.max[axis] - centroid_bounds.min[axis]);
+            auto first = prim_store.begin() + node.left_first;
+            auto middle = std::partition(first, first + node.count, [&](const uint32_t prim) {
+                return bin_index(centroids[prim], axis, centroid_bounds, scale) <= bin;
+            });
+            left_count = middle - first;
+        }
+
+        const uint32_t left = node_count.fetch_add(2);
+        node_store[left].left_first = node.left_first;
+        node_store[left].count = left_count;
+        node_store[left].bounds = left_bounds;
+        node_store[left + 1].left_first = node.left_first + left_count;
+        node_store[left + 1].count = node.count - left_count;
+        node_store[left + 1].bounds = right_bounds;
+        node.left_first = left;
+        node.count = 0;
+
+        if (task_threads > 1 && left_count > PARALLEL_THRESHOLD && node_store[left + 1].count > PARALLEL_THRESHOLD) {
+            const unsigned left_threads = task_threads / 2;
+            std::thread left_task([&, left] { subdivide(left, prim_bounds, node_count, depth + 1, left_threads); });
+            subdivide(left + 1, prim_bounds, node_count, depth + 1, task_threads - left_threads);
+            left_task.join();
+        } else {
+            subdivide(left, prim_bounds, node_count, depth + 1, task_threads);
+            subdivide(left + 1, prim_bounds, node_count, depth + 1, task_threads);
+        }
+    }
+
+    // spreads the low 21 bits of v so that there are two zero bits between each of them
+    static inline uint64_t expand_bits(uint64_t v) {
+        v &= 0x1fffff;
+        v = (v | v << 32) & 0x1f00000000ffffull;
+        v = (v | v << 16) & 0x1f0000ff0000ffull;
+        v = (v | v << 8)  & 0x100f00f00f00f00full;
+        v = (v | v << 4)  & 0x10c30c30c30c30c3ull;
+        v = (v | v << 2)  & 0x1249249249249249ull;
+        return v;
+    }
+
+    // 63-bit morton code of every centroid, quantized to 21 bits per axis inside the centroid bounds
+    std::vector<uint64_t> morton_codes(const AABB& centroid_bounds) const {
+        const uint32_t n = centroids.size();
+        std::vector<uint64_t> codes(n);
+        float scale[3];
+        for (int axis = 0; axis < 3; ++axis) {
+            const float extent = centroid_bounds.max[axis] - centroid_bounds.min[axis];
+            scale[axis] = extent > 0 ? float(0x1fffff) / extent : 0;
+        }
+        parallel_chunks(n, n > PARALLEL_THRESHOLD ? threads : 1, [&](size_t, size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                uint64_t code = 0;
+                for (int axis = 0; axis < 3; ++axis) {
+                    const uint64_t q = uint64_t((centroids[i][axis] - centroid_bounds.min[axis]) * scale[axis]);
+                    code |= expand_bits(std::min<uint64_t>(q, 0x1fffff)) << (2 - axis);
+                }
+                codes[i] = code;
+            }
+        });
+        return codes;
+    }
+
+    // parallel lsd radix sort of the codes, permuting the primitive indices along with them
+    void radix_sort(std::vector<uint64_t>& codes) {
+        constexpr int RADIX_BITS = 8;
+        constexpr int RADIX = 1 << RADIX_BITS;
+        const size_t n = codes.size();
+        const unsigned chunks = n > PARALLEL_THRESHOLD ? threads : 1;
+
+        std::vector<uint64_t> codes_tmp(n);
+        std::vector<uint32_t> prims_tmp(n);
+        std::vector<std::array<uint32_t, RADIX>> histograms(chunks);
+
+        for (int shift = 0; shift < 63; shift += RADIX_BITS) {
+            const size_t used = parallel_chunks(n, chunks, [&](size_t c, size_t begin, size_t end) {
+                histograms[c].fill(0);
+                for (size_t i = begin; i < end; ++i) histograms[c][(codes[i] >> shift) & (RADIX - 1)]++;
+            });
+
+            // turn the per-chunk counts into scatter offsets, skipping passes where every key shares the digit
+            uint32_t offset = 0;
+            bool trivial = false;
+            for (int d = 0; d < RADIX; ++d) {
+                uint32_t digit_total = 0;
+                for (size_t c = 0; c < used; ++c) {
+                    const uint32_t count = histograms[c][d];
+                    histograms[c][d] = offset + digit_total;
+                    digit_total += count;
+                }
+                trivial |= digit_total == n;
+                offset += digit_total;
+            }
+            if (trivial) continue;
+
+            parallel_chunks(n, used, [&](size_t c, size_t begin, size_t end) {
+                for (size_t i = begin; i < end; ++i) {
+                    const uint32_t dst = histograms[c][(codes[i] >> shift) & (RADIX - 1)]++;
+                    codes_tmp[dst] = codes[i];
+                    prims_tmp[dst] = prim_store[i];
+                }
+            });
+            codes.swap(codes_tmp);
+            prim_store.swap(prims_tmp);
+        }
+    }
+
+    // index of the last primitive in [first, last] that goes to the left child: the split is placed
+    // where the highest differing bit of the sorted codes flips
+    static uint32_t morton_split(const std::vector<uint64_t>& codes, const uint32_t first, const uint32_t last) {
+        const uint64_t first_code = codes[first];
+        const uint64_t last_code = codes[last];
+        if (first_code == last_code) return (first + last) / 2;
+
+        const int common_prefix = std::countl_zero(first_code ^ last_code);
+        uint32_t split = first;
+        uint32_t step = last - first;
+        do {
+            step = (step + 1) / 2;
+            const uint32_t candidate = split + step;
+            if (candidate < last && std::countl_zero(first_code ^ codes[candidate]) > common_prefix)
+                split = candidate;
+        } while (step > 1);
+        return split;
+    }
+
+    void emit_lbvh(const uint32_t idx, const std::vector<AABB>& prim_bounds, const std::vector<uint64_t>& codes,
+    std::atomic<uint32_t>& node_count, const int depth, const unsigned task_threads) {
+        BVHNode& node = node_store[idx];
+        if (node.count <= std::max(LBVH_LEAF_SIZE, leaf_width) || depth >= MAX_DEPTH - 1) {
+            node.bounds = AABB();
+            for (uint32_t i = 0; i < node.count; ++i)
+                node.bounds.grow(prim_bounds[prim_store[node.left_first + i]]);
+            return;
+        }
+
+        const uint32_t split = morton_split(codes, node.left_first, node.left_first + node.count - 1);
+        const uint32_t left_count = split - node.left_first + 1;
+
+        const uint32_t left = node_count.fetch_add(2);
+        node_store[left].left_first = node.left_first;
+        node_store[left].count = left_count;
+        node_store[left + 1].left_first = split + 1;
+        node_store[left + 1].count = node.count - left_count;
+        node.left_first = left;
+        node.count = 0;
+
+        if (task_threads > 1 && left_count > PARALLEL_THRESHOLD && node_store[left + 1].count > PARALLEL_THRESHOLD) {
+            const unsigned left_threads = task_threads / 2;
+            std::thread left_task([&, left] { emit_lbvh(left, prim_bounds, codes, node_count, depth + 1, left_threads); });
+            emit_lbvh(left + 1, prim_bounds, codes, node_count, depth + 1, task_threads - left_threads);
+            left_task.join();
+        } else {
+            emit_lbvh(left, prim_bounds, codes, node_count, depth + 1, task_threads);
+            emit_lbvh(left + 1, prim_bounds, codes, node_count, depth + 1, task_threads);
+        }
+
+        node.bounds = node_store[left].bounds;
+        node.bounds.grow(node_store[left + 1].bounds);
+    }
+};
@@ -0,0 +1,342 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <numbers>
+#include <string>
+#include <vector>
+
+#if defined(__F16C__)
+#include <immintrin.h>
+#endif
+
+#include "types.h"
+#include "parallel.h"
+#include "mapped_file.h"
+#include "stb_image.h"
+
+inline uint16_t float_to_half(const float f) {
+#if defined(__F16C__)
+    return _cvtss_sh(f, _MM_FROUND_TO_NEAREST_INT);
+#else
+    const uint32_t bits = std::bit_cast<uint32_t>(f);
+    const uint16_t sign = (bits >> 16) & 0x8000;
+    const int exponent = int((bits >> 23) & 0xff) - 127 + 15;
+    uint32_t mantissa = bits & 0x7fffff;
+    if (((bits >> 23) & 0xff) == 0xff) return sign | 0x7c00 | (mantissa ? 0x200 : 0); // inf, nan
+    if (exponent >= 31) return sign | 0x7c00;
+    if (exponent <= 0) { // subnormal half or zero
+        if (exponent < -10) return sign;
+        mantissa |= 0x800000;
+        const int shift = 14 - exponent;
+        return sign | ((mantissa >> shift) + ((mantissa >> (shift - 1)) & 1));
+    }
+    // rounding may carry into the exponent, which is still the right result
+    return (sign | (exponent << 10) | (mantissa >> 13)) + ((mantissa >> 12) & 1);
+#endif
+}
+
+inline float half_to_float(const uint16_t h) {
+#if defined(__F16C__)
+    return _cvtsh_ss(h);
+#else
+    const uint32_t sign = uint32_t(h & 0x8000) << 16;
+    const uint32_t exponent = (h >> 10) & 0x1f, mantissa = h & 0x3ff;
+    if (exponent == 0) {
+        const float f = mantissa * (1.f / (1 << 24));
+        return sign ? -f : f;
+    }
+    if (exponent == 31) return std::bit_cast<float>(sign | 0x7f800000 | (mantissa << 13));
+    return std::bit_cast<float>(sign | ((exponent + 112) << 23) | (mantissa << 13));
+#endif
+}
+
+// atan2 through a polynomial for atan on [0, 1] (abramowitz & stegun 4.4.49), absolute error below 1e-5,
+// which is under a hundredth of a texel of the largest maps we use
+inline float fast_atan2(const float y, const float x) {
+    const float ax = std::abs(x), ay = std::abs(y);
+    const float mx = std::max(ax, ay);
+    if (mx == 0) return 0;
+    const float a = std::min(ax, ay) / mx;
+    const float s = a * a;
+    float r = ((((-0.0117212f * s + 0.05265332f) * s - 0.11643287f) * s + 0.19354346f) * s - 0.33262347f) * s * a + 0.99997726f * a;
+    if (ay > ax) r = float(std::numbers::pi / 2) - r;
+    if (x < 0) r = float(std::numbers::pi) - r;
+    return y < 0 ? -r : r;
+}
+
+// asin through a polynomial and a square root (abramowitz & stegun 4.4.46), absolute error below 1e-6
+inline float fast_asin(const float x) {
+    const float a = std::min(std::abs(x), 1.f);
+    const float p = ((((((-0.0012624911f * a + 0.0066700901f) * a - 0.0170881256f) * a + 0.0308918810f) * a
+        - 0.0501743046f) * a + 0.0889789874f) * a - 0.2145988016f) * a + 1.5707963050f;
+    const float r = float(std::numbers::pi / 2) - std::sqrt(1 - a) * p;
+    return x < 0 ? -r : r;
+}
+
+// the srgb transfer function and its inverse, on the 0..1 scale
+inline float srgb_to_linear(const float c) {
+    return c <= 0.04045f ? c * (1 / 12.92f) : std::pow((c + 0.055f) * (1 / 1.055f), 2.4f);
+}
+
+inline float linear_to_srgb(const float c) {
+    return c <= 0.0031308f ? c * 12.92f : 1.055f * std::pow(c, 1 / 2.4f) - 0.055f;
+}
+
+// linear_to_srgb sampled at SRGB_TABLE_SIZE + 1 even steps over 0..1, linearly interpolated it stays within 2.5e-4
+// of the exact curve, a sixteenth of an 8 bit step
+constexpr int SRGB_TABLE_SIZE = 1024;
+inline const std::array<float, SRGB_TABLE_SIZE + 1> srgb_table = [] {
+    std::array<float, SRGB_TABLE_SIZE + 1> table;
+    for (int i = 0; i <= SRGB_TABLE_SIZE; ++i) table[i] = linear_to_srgb(float(i) / SRGB_TABLE_SIZE);
+    return table;
+}();
+
+// linear_to_srgb from the table, for values clamped to 0..1
+inline float linear_to_srgb_fast(const float c) {
+    const float x = std::clamp(c, 0.f, 1.f) * SRGB_TABLE_SIZE;
+    const int i = std::min(int(x), SRGB_TABLE_SIZE - 1);
+    return srgb_table[i] + (srgb_table[i + 1] - srgb_table[i]) * (x - i);
+}
+
+// equirectangular environment, decoded once and kept as linear float rgb (or half floats to halve the memory)
+// together with a box filtered mip chain. the texels of all levels are cached next to the image, keyed by its size
+// and modification time, so later runs skip the jpeg decoding and the filtering
+struct EnvironmentMap {
+    struct Level {
+        int width, height;
+        size_t offset; // of the first texel's red channel in texels or half_texels
+    };
+
+    int width = 0, height = 0; // of the finest level
+    bool half = false;
+    std::vector<Level> levels = {};
+    std::vector<float> texels = {};         // rgb, row major, finest level first
+    std::vector<uint16_t> half_texels = {}; // same layout when half is set
+
+    EnvironmentMap() = default;
+
+    EnvironmentMap(const std::string& path, const bool use_half = false) : half(use_half) {
+        auto start = std::chrono::steady_clock::now();
+        const std::string cache_path = path + (half ? ".half.cache" : ".cache"); // one per texel format
+        std::error_code error;
+        const uint64_t source_size = std::filesystem::file_size(path, error);
+        if (error) {
+            std::cerr << "Can't load environment map " << path << std::endl;
+            return;
+        }
+        const int64_t source_time = std::filesystem::last_write_time(path, error).time_since_epoch().count();
+
+        const bool cached = read_cache(cache_path, source_size, source_time);
+        if (!cached) {
+            if (!decode(path)) {
+                std::cerr << "Can't load environment map " << path << std::endl;
+                return;
+            }
+            write_cache(cache_path, source_size, source_time);
+        }
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+        std::cout << width << "x" << height << " environment map with " << levels.size() << " levels "
+            << (cached ? "read from cache" : "decoded") << " in " << elapsed.count() << "ms ("
+            << (half ? "half" : "float") << ", " << memory_bytes() / (1024*1024) << "MiB)" << std::endl;
+    }
+
+    bool empty() const { return width == 0; }
+
+    size_t memory_bytes() const {
+        return texels.size() * sizeof(float) + half_texels.size() * sizeof(uint16_t);
+    }
+
+    vec3f texel(const Level& level, const int x, const int y) const {
+        const size_t index = level.offset + (size_t(y) * level.width + x) * 3;
+        if (half) return vec3f(half_to_float(half_texels[index]), half_to_float(half_texels[index + 1]), half_to_float(half_texels[index + 2]));
+        return vec3f(texels[index], texels[index + 1], texels[index + 2]);
+    }
+
+    // radiance arriving along the normalized direction, averaged over a cone with the given full angle: the mip
+    // levels on either side of the cone's footprint are each sampled bilinearly and blended. the average is taken
+    // in linear light and then encoded back to srgb, the scale of the 8 bit image which the shading is tuned for.
+    // black when nothing was loaded. called for every ray leaving the scene, hence the polynomial approximations
+    // in place of atan2 and asin and the table in place of the srgb encoding's pow
+    vec3f lookup(const vec3f& dir, const float cone_angle = 0) const {
+        if (empty()) return vec3f(0, 0, 0);
+        const vec3f c = filtered(dir, cone_angle);
+        return vec3f(linear_to_srgb_fast(c.x), linear_to_srgb_fast(c.y), linear_to_srgb_fast(c.z));
+    }
+
+private:
+    static constexpr char CACHE_MAGIC[4] = {'E', 'N', 'V', 'C'};
+    static constexpr uint32_t CACHE_VERSION = 3;
+
+    struct CacheHeader {
+        char magic[4];
+        uint32_t version;
+        uint64_t source_size;
+        int64_t source_time;
+        int32_t width, height;
+        uint32_t half;
+    };
+
+    // lookup in linear light
+    vec3f filtered(const vec3f& dir, const float cone_angle) const {
+        constexpr float inv_pi = std::numbers::inv_pi;
+        const float u = 0.5f + fast_atan2(dir.z, dir.x) * (0.5f * inv_pi);
+        const float v = 0.5f - fast_asin(dir.y) * inv_pi;
+
+        // footprint in texels of the finest level, along the equator
+        const float footprint = cone_angle * width * (0.5f * inv_pi);
+        if (footprint <= 1) return bilinear(levels.front(), u, v);
+        const float lod = std::log2(footprint);
+        if (lod >= float(levels.size() - 1)) return bilinear(levels.back(), u, v);
+        const int l = int(lod);
+        const float t = lod - l;
+        return bilinear(levels[l], u, v) * (1 - t) + bilinear(levels[l + 1], u, v) * t;
+    }
+
+    // wraps around horizontally, clamps at the poles
+    vec3f bilinear(const Level& level, const float u, const float v) const {
+        const float x = u * level.width - 0.5f, y = v * level.height - 0.5f;
+        const float fx = std::floor(x), fy = std::floor(y);
+        const float tx = x - fx, ty = y - fy;
+        int x0 = int(fx) % level.width;
+        if (x0 < 0) x0 += level.width;
+        const int x1 = x0 + 1 == level.width ? 0 : x0 + 1;
+        const int y0 = std::clamp(int(fy), 0, level.height - 1);
+        const int y1 = std::clamp(int(fy) + 1, 0, level.height - 1);
+        return (texel(level, x0, y0) * (1 - tx) + texel(level, x1, y0) * tx) * (1 - ty)
+             + (texel(level, x0, y1) * (1 - tx) + texel(level, x1, y1) * tx) * ty;
+    }
+
+    // halves the size down to a single texel, returns the total number of channels
+    size_t layout_levels() {
+        levels.clear();
+        size_t offset = 0;
+        int w = width, h = height;
+        while (true) {
+            levels.push_back({w, h, offset});
+            offset += size_t(w) * h * 3;
+            if (w == 1 && h == 1) break;
+            w = std::max(1, w / 2);
+            h = std::max(1, h / 2);
+        }
+        return offset;
+    }
+
+    // the srgb texels of the image are decoded to linear light, in which the coarser levels average the 2x2 texels
+    // they cover, odd last rows and columns being dropped
+    bool decode(const std::string& path) {
+        int channels;
+        unsigned char* data = stbi_load(path.c_str(), &width, &height, &channels, 3);
+        if (!data) {
+            width = height = 0;
+            return false;
+        }
+        std::vector<float> chain(layout_levels());
+        float linear[256];
+        for (int i = 0; i < 256; ++i) linear[i] = srgb_to_linear(i * (1/255.f));
+        const size_t n = size_t(width) * height * 3;
+        for (size_t i = 0; i < n; ++i) chain[i] = linear[data[i]];
+        stbi_image_free(data);
+
+        for (size_t l = 1; l < levels.size(); ++l) {
+            const Level& src = levels[l - 1];
+            const Level& dst = levels[l];
+            const int sx = src.width > 1 ? 2 : 1, sy = src.height > 1 ? 2 : 1;
+            parallel_chunks(dst.height, thread_count, [&](size_t, const size_t begin, const size_t end) {
+                for (size_t y = begin; y < end; ++y) {
+                    for (int x = 0; x < dst.width; ++x) {
+                        for (int c = 0; c < 3; ++c) {
+                            float sum = 0;
+                            for (int j = 0; j < sy; ++j)
+                                for (int i = 0; i < sx; ++i)
+                                    sum += chain[src.offset + ((y*sy + j) * src.width + x*sx + i) * 3 + c];
+                            chain[dst.offset + (y * dst.width + x) * 3 + c] = sum / (sx * sy);
+                        }
+                    }
+                }
+            });
+        }
+
+        if (half) {
+            half_texels.resize(chain.size());
+            for (size_t i = 0; i < chain.size(); ++i) half_texels[i] = float_to_half(chain[i]);
+        } else {
+            texels = std::move(chain);
+        }
+        return true;
+    }
+
+    bool read_cache(const std::string& cache_path, const uint64_t source_size, const int64_t source_time) {
+        std::ifstream file(cache_path, std::ios::binary);
+        CacheHeader header{};
+        if (!file.read(reinterpret_cast<char*>(&header), sizeof(header))) return false;
+        if (memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) || header.version != CACHE_VERSION
+            || header.source_size != source_size || header.source_time != source_time
+            || header.half != uint32_t(half) || header.width <= 0 || header.height <= 0)
+            return false;
+
+        width = header.width;
+        height = header.height;
+        const size_t n = layout_levels();
+        char* target;
+        size_t bytes;
+        if (half) {
+            half_texels.resize(n);
+            target = reinterpret_cast<char*>(half_texels.data());
+            bytes = n * sizeof(uint16_t);
+        } else {
+            texels.resize(n);
+            target = reinterpret_cast<char*>(texels.data());
+            bytes = n * sizeof(float);
+        }
+        if (!file.read(target, bytes)) {
+            width = height = 0;
+            levels = {};
+            texels = {};
+            half_texels = {};
+            return false;
+        }
+        return true;
+    }
+
+    // a cache that can't be written only costs the decoding next time. it goes to a temporary file renamed over
+    // the cache at the end, so that no reader ever sees a partial one
+    void write_cache(const std::string& cache_path, const uint64_t source_size, const int64_t source_time) const {
+        // zeroed whole, padding included, so that the same map always gives the same file
+        CacheHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+        header.version = CACHE_VERSION;
+        header.source_size = source_size;
+        header.source_time = source_time;
+        header.width = width;
+        header.height = height;
+        header.half = half;
+
+        const std::string temp_path = temp_path_for(cache_path);
+        {
+            std::ofstream file(temp_path, std::ios::binary | std::ios::trunc);
+            file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            if (half) file.write(reinterpret_cast<const char*>(half_texels.data()), half_texels.size() * sizeof(uint16_t));
+            else file.write(reinterpret_cast<const char*>(texels.data()), texels.size() * sizeof(float));
+            if (!file) {
+                file.close();
+                std::error_code error;
+                std::filesystem::remove(temp_path, error);
+                return;
+            }
+        }
+        std::error_code error;
+        std::filesystem::rename(temp_path, cache_path, error);
+        if (error) std::filesystem::remove(temp_path, error);
+    }
+};
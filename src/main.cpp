@@ -1,14 +1,25 @@
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include "stb_image_write.h"
-#define STB_IMAGE_IMPLEMENTATION
-#include "stb_image.h"
-
 #include <limits>
 #include <cmath>
+#include <bit>
 #include <vector>
+#include <chrono>
+#include <memory>
+#include <cstdlib>
+#include <numeric>
+#include <algorithm>
+#include <cstring>
 #include "types.h"
 #include "shapes.h"
 #include "model.h"
+#include "scene.h"
+#include "environment.h"
+#include "parallel.h"
+
+// the implementations come after the headers that include stb_image.h for its declarations only
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
 
 #define PI 3.14159265358979323846
 
@@ -24,170 +35,461 @@ vec3f refract(const vec3f &I, const vec3f &N, const float eta_t, const float eta
     return k<0 ? vec3f(1,0,0) : I*eta + N*(eta*cosi - sqrtf(k));
 }
 
-bool scene_intersect(const vec3f& origin, const vec3f& direction, const std::vector<Sphere>& spheres,
-vec3f& hit, vec3f& N, Model& duck, Material& material) {
-    float spheres_dist = std::numeric_limits<float>::max();
-    for (size_t i = 0; i < spheres.size(); ++i) {
-        float dist_i;
-        if (spheres[i].ray_intersect(origin, direction, dist_i) && dist_i < spheres_dist) {
-            spheres_dist = dist_i;
-            hit = origin + direction*dist_i; // the ray that hit
-            N = (hit - spheres[i].center).normalize(); // surface normal
-            material = spheres[i].material;
-        }
-    }
+constexpr size_t MAX_RAY_DEPTH = 4;
+constexpr float MIN_RAY_WEIGHT = 1e-3; // rays contributing less than this to the pixel are not traced
 
-    float duck_best_t = std::numeric_limits<float>::max();
-    int   duck_best_f = -1;
+// the ray from a surface point towards a light, started off the side of the surface facing the light
+void shadow_ray(const vec3f& point, const vec3f& N, const Light& light, vec3f& shadow_origin, vec3f& light_dir, float& light_distance) {
+    light_dir = (light.position - point).normalize();
+    light_distance = (light.position - point).norm();
+    shadow_origin = light_dir * N < 0 ? point - N * 1e-3 /* pointing in different directions*/: point + N * 1e-3;
+}
 
-    for (int f = 0; f < duck.nfaces(); ++f) {
-        float t;
-        if (duck.ray_intersect(origin, direction, f, t) && t < duck_best_t) {
-            duck_best_t = t;
-            duck_best_f = f;
+// the first hit of a primary ray traced ahead of the shading, by cast_packet, with bit i of occluded set when
+// lights[i] is in shadow there
+struct PrimaryHit {
+    bool hit = false;
+    vec3f point, N;
+    Material material;
+    float curvature = 0;
+    uint64_t occluded = 0;
+};
+
+// cone_angle is the angle a primary ray covers, it widens the environment lookups to the pixel's footprint.
+// with primary given, the first hit and its shadows are taken from there rather than traced again
+vec3f cast_ray(const vec3f& origin, const vec3f& direction, const Scene& scene, const std::vector<Light>& lights,
+ const EnvironmentMap& environment, const float cone_angle = 0, const PrimaryHit* primary = nullptr) {
+    // the ray tree is walked depth first, every pending ray carrying the product of the albedos along its path
+    // and the cone around it: its width at the origin and its spread angle
+    struct RayTask {
+        vec3f origin, direction;
+        float weight;
+        size_t depth;
+        float cone_width, cone_angle;
+    };
+    RayTask stack[2*MAX_RAY_DEPTH + 2];
+    int stack_size = 0;
+    stack[stack_size++] = {origin, direction, 1.f, 0, 0.f, cone_angle};
+
+    vec3f color(0, 0, 0);
+    while (stack_size) {
+        const RayTask ray = stack[--stack_size];
+        vec3f point, N;
+        Material material;
+        float curvature;
+        const PrimaryHit* traced = ray.depth == 0 ? primary : nullptr;
+
+        if (traced) {
+            point = traced->point;
+            N = traced->N;
+            material = traced->material;
+            curvature = traced->curvature;
+        }
+        if (ray.depth > MAX_RAY_DEPTH || (traced ? !traced->hit : !scene.intersect(ray.origin, ray.direction, point, N, material, curvature))) {
+            color = color + environment.lookup(ray.direction, ray.cone_angle) * ray.weight;
+            continue;
         }
-    }
 
-    if (duck_best_f != -1 && duck_best_t < spheres_dist) {
-        spheres_dist = duck_best_t;
-        hit = origin + direction * duck_best_t;
-        
-        vec3f v0 = duck.vert(duck_best_f, 0);
-        vec3f v1 = duck.vert(duck_best_f, 1);
-        vec3f v2 = duck.vert(duck_best_f, 2);
-
-        vec3f duck_N = cross(v1 - v0, v2 - v0).normalize();
-        if (duck_N * direction > 0) duck_N = -duck_N;
-        N = duck_N;
-        material = duck.material;
-    }
-    
-    float checkerboard_dist = std::numeric_limits<float>::max();
-
-    if (fabs(direction.y) > 1e-3) {
-        float d = -(origin.y + 4) / direction.y;
-        vec3f pt = origin + direction * d;
-            if (d>0 && fabs(pt.x)<10 && pt.z<-10 && pt.z>-30 && d<spheres_dist) {
-                checkerboard_dist = d;
-                hit = pt;
-                N = vec3f(0,1,0);
-                material.diffuse_color = (int(.5*hit.x+1000) + int(.5*hit.z)) & 1 ? vec3f(1,1,1) : vec3f(1, .7, .3);
-                material.diffuse_color = material.diffuse_color*.3;
+        // curved surfaces spread the secondary cones, refraction is treated like reflection which overestimates
+        // the footprint behind glass rather than aliasing
+        const float cone_width = ray.cone_width + ray.cone_angle * (point - ray.origin).norm();
+        const float secondary_angle = ray.cone_angle + 2 * curvature * cone_width;
+
+        float diffuse_light_intensity = 0., specular_light_intensity = 0.;
+        for (size_t i = 0; i < lights.size(); ++i) {
+            vec3f shadow_origin, light_dir;
+            float light_distance;
+            shadow_ray(point, N, lights[i], shadow_origin, light_dir, light_distance);
+            // check if the point lies in the shadow of lights[i]
+            if (traced ? traced->occluded >> i & 1 : scene.occluded(shadow_origin, light_dir, light_distance))
+                continue;
+
+            diffuse_light_intensity += lights[i].intensity * std::max<float>(0., light_dir * N);
+            specular_light_intensity += powf(std::max(0.f, reflect(light_dir, N)* ray.direction), material.specular_exponent)*lights[i].intensity;
         }
-        
-    }
-    return std::min(spheres_dist, std::min(checkerboard_dist, duck_best_t)) < 1000;
-}
 
-vec3f cast_ray(const vec3f& origin, const vec3f& direction, const std::vector<Sphere>& spheres, const std::vector<Light>& lights, Model& duck,
- const vec3f& bg, size_t depth = 0) {
-	vec3f point, N;
-    Material material;
+        color = color + (material.diffuse_color * diffuse_light_intensity * material.albedo[0] + vec3f(1., 1., 1.)
+        * specular_light_intensity * material.albedo[1]) * ray.weight;
 
-    float diffuse_light_intensity = 0., specular_light_intensity = 0.;
+        float reflect_weight = ray.weight * material.albedo[2];
+        if (reflect_weight > MIN_RAY_WEIGHT) {
+            vec3f reflect_dir = reflect(ray.direction, N).normalize();
+            vec3f reflect_orig = reflect_dir * N < 0 ? point - N * 1e-3 : point + N * 1e-3;
+            stack[stack_size++] = {reflect_orig, reflect_dir, reflect_weight, ray.depth + 1, cone_width, secondary_angle};
+        }
 
-    if (depth > 4 || !scene_intersect(origin, direction, spheres, point, N, duck, material)) {
-        return bg;
+        float refract_weight = ray.weight * material.albedo[3];
+        if (refract_weight > MIN_RAY_WEIGHT) {
+            vec3f refract_dir = refract(ray.direction, N, material.refractive_index).normalize();
+            vec3f refract_orig = refract_dir * N < 0 ? point - N * 1e-3 : point + N * 1e-3;
+            stack[stack_size++] = {refract_orig, refract_dir, refract_weight, ray.depth + 1, cone_width, secondary_angle};
+        }
     }
 
-    vec3f reflect_dir = reflect(direction, N).normalize();
-    vec3f refract_dir = refract(direction, N, material.refractive_index).normalize();
-    
-    vec3f reflect_orig = reflect_dir * N < 0 ? point - N * 1e-3 : point + N * 1e-3;
-    vec3f refract_orig = refract_dir * N < 0 ? point - N * 1e-3 : point + N * 1e-3;
-
-    vec3f reflect_color = cast_ray(reflect_orig, reflect_dir, spheres, lights, duck, bg, depth + 1);
-    vec3f refract_color = cast_ray(refract_orig, refract_dir, spheres, lights, duck, bg, depth + 1);
-    
-    for (size_t i = 0; i < lights.size(); ++i) {
-        vec3f light_dir = (lights[i].position - point).normalize();
-        float light_distance = (lights[i].position - point).norm();
+    return color;
+}
 
-        vec3f shadow_origin = light_dir * N < 0 ? point - N * 1e-3 /* pointing in different directions*/: point + N * 1e-3; // check if the point lies in the shadow of lights[i] 
-        vec3f shadow_point, shadow_N;
-        Material tmp_material;
+// the primary rays of a packet traced together to their first hits, then the shadow rays from those hits to
+// each light as one packet per light, after which every lane is shaded on its own by cast_ray. lights.size()
+// must be at most 64
+void cast_packet(const RayPacket& packet, const uint32_t active, const Scene& scene, const std::vector<Light>& lights,
+ const EnvironmentMap& environment, const float cone_angle, vec3f* colors) {
+    Scene::Hit hits[RayPacket::N];
+    PrimaryHit primary[RayPacket::N];
+    const uint32_t found = scene.trace(packet, active, hits);
+    for (uint32_t mask = found; mask; mask &= mask - 1) {
+        const int lane = std::countr_zero(mask);
+        PrimaryHit& p = primary[lane];
+        scene.surface(packet.origin(lane), packet.direction(lane), hits[lane], p.point, p.N, p.material, p.curvature);
+        p.hit = true;
+    }
 
-        if (scene_intersect(shadow_origin, light_dir, spheres, shadow_point, shadow_N, duck, tmp_material) && (shadow_point - shadow_origin).norm() < light_distance)
-            continue;
+    for (size_t i = 0; i < lights.size() && found; ++i) {
+        // the shadow rays all end near the light, within the offset of their origins off the surfaces
+        RayPacket shadows;
+        shadows.apex = lights[i].position;
+        shadows.pad = 2e-3f;
+        float light_distance[RayPacket::N] = {};
+        for (uint32_t mask = found; mask; mask &= mask - 1) {
+            const int lane = std::countr_zero(mask);
+            vec3f shadow_origin, light_dir;
+            shadow_ray(primary[lane].point, primary[lane].N, lights[i], shadow_origin, light_dir, light_distance[lane]);
+            shadows.set(lane, shadow_origin, light_dir, primary[lane].point - lights[i].position);
+        }
+        for (uint32_t mask = scene.occluded(shadows, found, light_distance); mask; mask &= mask - 1)
+            primary[std::countr_zero(mask)].occluded |= uint64_t(1) << i;
+    }
 
-        diffuse_light_intensity += lights[i].intensity * std::max<float>(0., light_dir * N);
-        specular_light_intensity += powf(std::max(0.f, reflect(light_dir, N)* direction), material.specular_exponent)*lights[i].intensity;
+    for (uint32_t mask = active; mask; mask &= mask - 1) {
+        const int lane = std::countr_zero(mask);
+        colors[lane] = cast_ray(packet.origin(lane), packet.direction(lane), scene, lights, environment, cone_angle, &primary[lane]);
     }
+}
 
-    return material.diffuse_color * diffuse_light_intensity * material.albedo[0] + vec3f(1., 1., 1.)
-    * specular_light_intensity * material.albedo[1] + reflect_color*material.albedo[2] + refract_color*material.albedo[3];
+vec3f camera_dir(const size_t i, const size_t j, const int width, const int height, const float fov) {
+    // shift by 0.5 to get the "center" of the pixel as i just means the left boundary of i
+    const float aspect_ratio = width/(float)height;
+    float screen_width = tan(fov/2.) * aspect_ratio;
+    float x = (2*(i + 0.5) / (float)width - 1) * screen_width;
+    float y = -(2*(j + 0.5) / (float)height - 1) * /* world units*/(tan(fov/2.));
+
+    return vec3f(x, y, -1).normalize();
 }
 
-void render(const std::vector<Sphere>& spheres, std::vector<Light>& lights, Model& duck) {
+// builds the mesh bvh with every build mode and traces the primary rays against the mesh alone
+void bench_bvh(Model& duck) {
     constexpr int width    = 1024;
     constexpr int height   = 768;
     constexpr float fov = PI/3.;
-    int env_width, env_height, channels;
-    std::vector<vec3f> framebuffer(width*height);
 
-    auto* data = stbi_load("envmap.jpg", &env_width, &env_height, &channels, 0);
-
-#pragma omp parallel for
-    for (size_t j = 0; j<height; j++) {
-        for (size_t i = 0; i<width; i++) {
-            // shift by 0.5 to get the "center" of the pixel as i just means the left boundary of i
-            constexpr float aspect_ratio = width/(float)height;
-            float screen_width = tan(fov/2.) * aspect_ratio;
-            float x = (2*(i + 0.5) / (float)width - 1) * screen_width;
-            float y = -(2*(j + 0.5) / (float)height - 1) * /* world units*/(tan(fov/2.));
-                
-            vec3f dir = vec3f(x, y, -1).normalize();
+    for (BVH::BuildMode mode : {BVH::BuildMode::SAH, BVH::BuildMode::LBVH}) {
+    for (BVHLayout layout : {BVHLayout::Binary, BVHLayout::Wide, BVHLayout::Quantized}) {
+        duck.bvh.mode = mode;
+        duck.layout = layout;
+        double build_ms = duck.build_bvh();
+
+        size_t hits = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t j = 0; j<height; j++) {
+            for (size_t i = 0; i<width; i++) {
+                float t = std::numeric_limits<float>::max();
+                int face = -1;
+                hits += duck.intersect(vec3f(0,0,0), camera_dir(i, j, width, height, fov), t, face);
+            }
+        }
+        std::chrono::duration<double, std::milli> trace_ms = std::chrono::steady_clock::now() - start;
+
+        // the same rays again as packets of 4 pixels wide blocks
+        constexpr int packet_width = 4, packet_height = RayPacket::N / packet_width;
+        size_t packet_hits = 0;
+        start = std::chrono::steady_clock::now();
+        for (size_t j = 0; j<height; j += packet_height) {
+            for (size_t i = 0; i<width; i += packet_width) {
+                RayPacket packet;
+                packet.apex = vec3f(0,0,0);
+                float t[RayPacket::N];
+                int face[RayPacket::N];
+                for (int lane = 0; lane < RayPacket::N; ++lane) {
+                    const vec3f dir = camera_dir(i + lane % packet_width, j + lane / packet_width, width, height, fov);
+                    packet.set(lane, vec3f(0,0,0), dir, dir);
+                    t[lane] = std::numeric_limits<float>::max();
+                }
+                packet_hits += std::popcount(duck.intersect(packet, (uint32_t(1) << RayPacket::N) - 1, t, face));
+            }
+        }
+        std::chrono::duration<double, std::milli> packet_ms = std::chrono::steady_clock::now() - start;
 
-            float u = 0.5f + atan2(dir.z, dir.x) / (2 * PI);
-            float v = 0.5f - asin(dir.y) / PI;
+        std::cout << (mode == BVH::BuildMode::LBVH ? "lbvh" : "sah")
+            << (layout == BVHLayout::Wide ? " wide" : layout == BVHLayout::Quantized ? " quantized" : " binary")
+            << ": build " << build_ms << "ms, " << duck.bvh_bytes() / 1024 << "KiB, trace " << trace_ms.count()
+            << "ms (" << width*height / (trace_ms.count() * 1e3) << " Mrays/s, " << hits << " hits), packets " << packet_ms.count()
+            << "ms (" << width*height / (packet_ms.count() * 1e3) << " Mrays/s, " << packet_hits << " hits)" << std::endl;
+    }
+    }
+}
 
-            int px = std::min(env_width - 1, std::max(0, int(u * env_width)));
-            int py = std::min(env_height - 1, std::max(0, int(v * env_height)));
-            int index = (py * env_width + px) * 3;
+constexpr int TILE_SIZE = 16;
+
+// interleaves the bits of x and y
+uint32_t morton2(uint32_t x, uint32_t y) {
+    auto spread = [](uint32_t v) {
+        v &= 0xffff;
+        v = (v | v << 8) & 0x00ff00ff;
+        v = (v | v << 4) & 0x0f0f0f0f;
+        v = (v | v << 2) & 0x33333333;
+        v = (v | v << 1) & 0x55555555;
+        return v;
+    };
+    return spread(x) | spread(y) << 1;
+}
 
-            float r = data[index + 0];
-            float g = data[index + 1];
-            float b = data[index + 2];
+// coarsest pixel grid of a progressive render, every following pass halves the spacing until all pixels are done
+constexpr int PROGRESSIVE_STRIDE = 8;
 
-            framebuffer[i+j*width] = cast_ray(vec3f(0,0,0), dir, spheres, lights, duck, vec3f(r, g, b) * (1/255.));
-        }
-    }
-    stbi_image_free(data);
+struct RenderSettings {
+    bool progressive = false;
+    double preview_interval = 1000.; // milliseconds between preview images of a progressive render
+    bool packets = true; // primary and shadow rays traced as packets of neighbouring pixels, except in progressive renders
+};
 
+void write_image(const std::vector<vec3f>& framebuffer, const int width, const int height, const char* path) {
     std::vector<unsigned char> image(width * height * 3);
 
-    for (size_t i = 0; i < height * width; ++i) {
-        vec3f &c = framebuffer[i];
+    for (size_t i = 0; i < size_t(height * width); ++i) {
+        vec3f c = framebuffer[i];
         float max = std::max(c[0], std::max(c[1], c[2]));
         if (max > 1) c = c*(1./max);
-        image[3*i + 0] = (unsigned char)(255 * std::max(0.f, std::min(1.f, framebuffer[i][0])));
-        image[3*i + 1] = (unsigned char)(255 * std::max(0.f, std::min(1.f, framebuffer[i][1])));
-        image[3*i + 2] = (unsigned char)(255 * std::max(0.f, std::min(1.f, framebuffer[i][2])));
+        image[3*i + 0] = (unsigned char)(255 * std::max(0.f, std::min(1.f, c[0])));
+        image[3*i + 1] = (unsigned char)(255 * std::max(0.f, std::min(1.f, c[1])));
+        image[3*i + 2] = (unsigned char)(255 * std::max(0.f, std::min(1.f, c[2])));
     }
 
-    stbi_write_png("out.png", width, height, 3, image.data(), width * 3);
+    stbi_write_png(path, width, height, 3, image.data(), width * 3);
 }
 
-int main() {
+// returns the render time in milliseconds
+double render(const Scene& scene, std::vector<Light>& lights, const EnvironmentMap& environment, const RenderSettings& settings = {}) {
+    constexpr int width    = 1024;
+    constexpr int height   = 768;
+    constexpr float fov = PI/3.;
+    std::vector<vec3f> framebuffer(width*height);
+    // angle between neighbouring primary rays at the image center
+    const float pixel_angle = 2 * tan(fov/2.) / height;
+
+    // tiles in morton order, so the contiguous runs of tiles each thread starts with are compact blocks of the image
+    constexpr int tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+    constexpr int tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+    std::vector<uint32_t> tiles(tiles_x * tiles_y);
+    std::iota(tiles.begin(), tiles.end(), 0);
+    std::sort(tiles.begin(), tiles.end(), [&](const uint32_t a, const uint32_t b) {
+        return morton2(a % tiles_x, a / tiles_x) < morton2(b % tiles_x, b / tiles_x);
+    });
+
+    auto shade = [&](const size_t i, const size_t j) {
+        vec3f dir = camera_dir(i, j, width, height, fov);
+        framebuffer[i+j*width] = cast_ray(vec3f(0,0,0), dir, scene, lights, environment, pixel_angle);
+    };
+
+    // packets cover blocks of 4 pixels wide
+    constexpr int packet_width = 4, packet_height = RayPacket::N / packet_width;
+    auto shade_packet = [&](const size_t i, const size_t j, const size_t end_i, const size_t end_j) {
+        RayPacket packet;
+        packet.apex = vec3f(0,0,0);
+        uint32_t active = 0;
+        for (int lane = 0; lane < RayPacket::N; ++lane) {
+            const size_t pi = i + lane % packet_width, pj = j + lane / packet_width;
+            if (pi >= end_i || pj >= end_j) continue;
+            const vec3f dir = camera_dir(pi, pj, width, height, fov);
+            packet.set(lane, vec3f(0,0,0), dir, dir);
+            active |= 1u << lane;
+        }
+        vec3f colors[RayPacket::N];
+        cast_packet(packet, active, scene, lights, environment, pixel_angle, colors);
+        for (uint32_t mask = active; mask; mask &= mask - 1) {
+            const int lane = std::countr_zero(mask);
+            framebuffer[i + lane % packet_width + (j + lane / packet_width)*width] = colors[lane];
+        }
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    if (!settings.progressive) {
+        const bool packets = settings.packets && lights.size() <= 64;
+        parallel_for(tiles.size(), [&](const size_t t) {
+            const size_t tile_i = tiles[t] % tiles_x * TILE_SIZE, tile_j = tiles[t] / tiles_x * TILE_SIZE;
+            const size_t end_i = std::min<size_t>(tile_i + TILE_SIZE, width), end_j = std::min<size_t>(tile_j + TILE_SIZE, height);
+            if (packets) {
+                for (size_t j = tile_j; j < end_j; j += packet_height)
+                    for (size_t i = tile_i; i < end_i; i += packet_width)
+                        shade_packet(i, j, end_i, end_j);
+                return;
+            }
+            for (size_t j = tile_j; j < end_j; j++)
+                for (size_t i = tile_i; i < end_i; i++)
+                    shade(i, j);
+        });
+    } else {
+        // every pass shades the pixels on its grid that the coarser passes skipped. tiles are handed out in
+        // batches so that previews can be written between them while no thread touches the framebuffer
+        std::vector<uint8_t> done(width*height, 0);
+        auto last_preview = start;
+        auto write_preview = [&] {
+            // pixels not shaded yet take the color of the closest shaded corner of the coarser grids
+            std::vector<vec3f> preview(framebuffer);
+            for (size_t j = 0; j < height; j++) {
+                for (size_t i = 0; i < width; i++) {
+                    if (done[i+j*width]) continue;
+                    for (size_t s = 2; s <= PROGRESSIVE_STRIDE; s *= 2) {
+                        const size_t anchor = i - i%s + (j - j%s)*width;
+                        if (!done[anchor]) continue;
+                        preview[i+j*width] = framebuffer[anchor];
+                        break;
+                    }
+                }
+            }
+            write_image(preview, width, height, "out.png");
+            last_preview = std::chrono::steady_clock::now();
+            std::chrono::duration<double, std::milli> elapsed = last_preview - start;
+            std::cout << "preview written after " << elapsed.count() << "ms" << std::endl;
+        };
+
+        const size_t batch = size_t(thread_count) * 16;
+        for (size_t stride = PROGRESSIVE_STRIDE; stride >= 1; stride /= 2) {
+            for (size_t first = 0; first < tiles.size(); first += batch) {
+                parallel_for(std::min(batch, tiles.size() - first), [&](const size_t t) {
+                    const size_t tile_i = tiles[first + t] % tiles_x * TILE_SIZE, tile_j = tiles[first + t] / tiles_x * TILE_SIZE;
+                    for (size_t j = tile_j; j < std::min<size_t>(tile_j + TILE_SIZE, height); j += stride) {
+                        for (size_t i = tile_i; i < std::min<size_t>(tile_i + TILE_SIZE, width); i += stride) {
+                            if (done[i+j*width]) continue;
+                            shade(i, j);
+                            done[i+j*width] = 1;
+                        }
+                    }
+                });
+                const bool last = stride == 1 && first + batch >= tiles.size();
+                std::chrono::duration<double, std::milli> since = std::chrono::steady_clock::now() - last_preview;
+                if (!last && since.count() >= settings.preview_interval) write_preview();
+            }
+            // the coarsest pass always ends with a preview, whatever the interval
+            if (stride == PROGRESSIVE_STRIDE && last_preview == start) write_preview();
+        }
+    }
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+    write_image(framebuffer, width, height, "out.png");
+
+    std::cout << "rendered in " << elapsed.count() << "ms on " << thread_count << " threads" << std::endl;
+    return elapsed.count();
+}
+
+// renders the scene with 1, 2, 4, ... up to thread_count threads and reports the speedup over one thread
+void bench_scaling(const Scene& scene, std::vector<Light>& lights, const EnvironmentMap& environment) {
+    const unsigned max_threads = thread_count;
+    double single = 0;
+    for (unsigned threads = 1; ; threads = std::min(threads * 2, max_threads)) {
+        thread_count = threads;
+        double ms = render(scene, lights, environment);
+        if (threads == 1) single = ms;
+        std::cout << threads << " threads: " << ms << "ms, speedup " << single / ms << "x" << std::endl;
+        if (threads == max_threads) break;
+    }
+    thread_count = max_threads;
+}
+
+int main(int argc, char** argv) {
+    BVH::BuildMode bvh_mode = BVH::BuildMode::SAH;
+    BVHLayout bvh_layout = BVHLayout::Wide;
+    bool bvh_bench = false;
+    bool scaling = false;
+    RenderSettings settings;
+    bool envmap_half = false;
+    bool precompute_triangles = true;
+    bool pack_triangles = TRIANGLE_PACK_SIMD;
+    bool watertight = false;
+
+    for (int i = 1; i < argc; ++i) {
+        // unknown values of --bvh and --bvh-layout fall through to the usage message
+        if (!strcmp(argv[i], "--bvh") && i + 1 < argc && (!strcmp(argv[i + 1], "sah") || !strcmp(argv[i + 1], "lbvh"))) {
+            bvh_mode = !strcmp(argv[++i], "lbvh") ? BVH::BuildMode::LBVH : BVH::BuildMode::SAH;
+        } else if (!strcmp(argv[i], "--bvh-layout") && i + 1 < argc
+            && (!strcmp(argv[i + 1], "binary") || !strcmp(argv[i + 1], "wide") || !strcmp(argv[i + 1], "quantized"))) {
+            ++i;
+            bvh_layout = !strcmp(argv[i], "binary") ? BVHLayout::Binary : !strcmp(argv[i], "quantized") ? BVHLayout::Quantized : BVHLayout::Wide;
+        } else if (!strcmp(argv[i], "--bvh-bench")) {
+            bvh_bench = true;
+        } else if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+            thread_count = std::max(1, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--scaling")) {
+            scaling = true;
+        } else if (!strcmp(argv[i], "--envmap-half")) {
+            envmap_half = true;
+        } else if (!strcmp(argv[i], "--indexed-triangles")) {
+            precompute_triangles = false;
+        } else if (!strcmp(argv[i], "--single-triangles")) {
+            pack_triangles = false;
+        } else if (!strcmp(argv[i], "--watertight")) {
+            watertight = true;
+        } else if (!strcmp(argv[i], "--single-rays")) {
+            settings.packets = false;
+        } else if (!strcmp(argv[i], "--progressive")) {
+            settings.progressive = true;
+        } else if (!strcmp(argv[i], "--preview-interval") && i + 1 < argc) {
+            settings.progressive = true;
+            settings.preview_interval = std::max(0., atof(argv[++i]) * 1000.);
+        } else {
+            std::cerr << "usage: " << argv[0] << " [--bvh sah|lbvh] [--bvh-layout binary|wide|quantized] [--bvh-bench] [--threads N] [--scaling] [--progressive] [--preview-interval SECONDS] [--envmap-half] [--indexed-triangles] [--single-triangles] [--watertight] [--single-rays]" << std::endl;
+            return 1;
+        }
+    }
+
     Material      ivory(1.0, vec4f(0.6,  0.3, 0.1, 0.0), vec3f(0.4, 0.4, 0.3),   50.);
     Material      glass(1.5, vec4f(0.0,  0.5, 0.1, 0.8), vec3f(0.6, 0.7, 0.8),  125.);
     Material red_rubber(1.0, vec4f(0.9,  0.1, 0.0, 0.0), vec3f(0.3, 0.1, 0.1),   10.);
     Material     mirror(1.0, vec4f(0.0, 10.0, 0.8, 0.0), vec3f(1.0, 1.0, 1.0), 1425.);
 
-    std::vector<Sphere> spheres;
-    spheres.push_back(Sphere(vec3f(-3,    0,   -16), 2,      ivory));
-    spheres.push_back(Sphere(vec3f(-1.0, -1.5, -12), 2,      glass));
-    spheres.push_back(Sphere(vec3f( 1.5, -0.5, -18), 3, red_rubber));
-    spheres.push_back(Sphere(vec3f( 7,    5,   -18), 4,     mirror));
+    Scene scene;
+    scene.spheres.push_back(Sphere(vec3f(-3,    0,   -16), 2,      ivory));
+    scene.spheres.push_back(Sphere(vec3f(-1.0, -1.5, -12), 2,      glass));
+    scene.spheres.push_back(Sphere(vec3f( 1.5, -0.5, -18), 3, red_rubber));
+    scene.spheres.push_back(Sphere(vec3f( 7,    5,   -18), 4,     mirror));
+    scene.checkerboards.push_back(Checkerboard(-4, vec3f(-10, 0, -30), vec3f(10, 0, -10)));
 
     std::vector<Light> lights;
     lights.push_back(Light(vec3f{-20., 20, 20.}, 1.5));
     lights.push_back(Light(vec3f( 30, 50, -25), 1.8));
     lights.push_back(Light(vec3f( 30, 20,  30), 1.7));
 
-    auto duck = Model("duck.obj", glass);
+    auto duck = std::make_shared<Model>("duck.obj", bvh_mode, bvh_layout, precompute_triangles, pack_triangles);
+    duck->watertight = watertight;
+
+    if (bvh_bench) {
+        bench_bvh(*duck);
+        return 0;
+    }
+
+    scene.instances.push_back(Instance(duck, mat3x4(), glass));
+    // smaller copies standing on the checkerboard and turned to either side, all sharing the one mesh and bvh
+    if (!duck->bounds.empty()) {
+        const vec3f center = duck->bounds.centroid();
+        const float scale = .4f;
+        const float lift = scale * (center.y - duck->bounds.min.y);
+        const struct { float x, z, angle; const Material& material; } copies[] = {
+            {-7, -13, float(PI/4), ivory}, {-4.5, -22, float(-PI/3), red_rubber}, {5, -12, float(-3*PI/4), ivory}, {8, -24, float(PI), mirror}};
+        for (const auto& copy : copies) {
+            const mat3x4 transform = mat3x4::translation(vec3f(copy.x, -4 + lift, copy.z)) * mat3x4::rotation_y(copy.angle)
+                * mat3x4::scale(scale) * mat3x4::translation(vec3f(0, 0, 0) - center);
+            scene.instances.push_back(Instance(duck, transform, copy.material));
+        }
+    }
+    scene.build();
+
+    const EnvironmentMap environment("envmap.jpg", envmap_half);
+
+    if (scaling) {
+        bench_scaling(scene, lights, environment);
+        return 0;
+    }
 
-    render(spheres, lights, duck);
+    render(scene, lights, environment, settings);
 
     return 0;
 }
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <span>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <filesystem>
+#include <type_traits>
+
+#include "mapped_file.h"
+
+// binary cache of a parsed source file: a header followed by blocks of raw array data, each starting on a 64 byte
+// boundary so that the arrays can be used in place from a read only mapping of the file. the meaning of the
+// blocks is up to the user, the cache only checks that it is recent enough for the source and has them all.
+// caches are keyed by the size and the modification time of the source, a changed source makes them stale
+struct MeshCache {
+    static constexpr char MAGIC[4] = {'T', 'R', 'M', 'C'};
+    static constexpr uint32_t VERSION = 1;
+    static constexpr uint32_t ENDIAN = 0x01020304; // read back differently on a machine of the other byte order
+    static constexpr size_t MAX_BLOCKS = 16;
+    static constexpr size_t ALIGNMENT = 64;
+
+    struct Key {
+        uint64_t source_size = 0;
+        int64_t source_time = 0;
+    };
+
+    struct Header {
+        char magic[4];
+        uint32_t version;
+        uint32_t endian;
+        uint32_t block_count;
+        Key key;
+        uint64_t offsets[MAX_BLOCKS]; // from the start of the file
+        uint64_t bytes[MAX_BLOCKS];
+    };
+
+    struct Block {
+        const void* data;
+        uint64_t bytes;
+    };
+
+    template <typename T>
+    static Block block(std::span<const T> array) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        return {array.data(), array.size_bytes()};
+    }
+
+    template <typename T>
+    static Block block(const std::vector<T>& array) {
+        return block(std::span<const T>(array));
+    }
+
+    // false when the source doesn't exist
+    static bool key(const std::string& source_path, Key& k) {
+        std::error_code error;
+        k.source_size = std::filesystem::file_size(source_path, error);
+        if (error) return false;
+        k.source_time = std::filesystem::last_write_time(source_path, error).time_since_epoch().count();
+        return !error;
+    }
+
+    // writes to a temporary file renamed over the cache at the end, processes mapping the old cache keep it
+    // intact and never see a partial one. failing to write only costs the parsing next time
+    static bool write(const std::string& cache_path, const Key& k, std::span<const Block> blocks) {
+        if (blocks.size() > MAX_BLOCKS) return false;
+        Header header = {};
+        memcpy(header.magic, MAGIC, sizeof(MAGIC));
+        header.version = VERSION;
+        header.endian = ENDIAN;
+        header.block_count = uint32_t(blocks.size());
+        header.key = k;
+        uint64_t offset = align(sizeof(Header));
+        for (size_t b = 0; b < blocks.size(); ++b) {
+            header.offsets[b] = offset;
+            header.bytes[b] = blocks[b].bytes;
+            offset = align(offset + blocks[b].bytes);
+        }
+
+        const std::string temp_path = temp_path_for(cache_path);
+        {
+            std::ofstream file(temp_path, std::ios::binary | std::ios::trunc);
+            const char padding[ALIGNMENT] = {};
+            file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            uint64_t written = sizeof(header);
+            for (size_t b = 0; b < blocks.size(); ++b) {
+                file.write(padding, header.offsets[b] - written);
+                file.write(static_cast<const char*>(blocks[b].data), blocks[b].bytes);
+                written = header.offsets[b] + blocks[b].bytes;
+            }
+            if (!file) {
+                file.close();
+                std::error_code error;
+                std::filesystem::remove(temp_path, error);
+                return false;
+            }
+        }
+        std::error_code error;
+        std::filesystem::rename(temp_path, cache_path, error);
+        if (error) std::filesystem::remove(temp_path, error);
+        return !error;
+    }
+
+    // maps the cache, left empty when it is missing, stale, from another version or short of blocks
+    static MappedFile open(const std::string& cache_path, const Key& k, const size_t block_count) {
+        MappedFile file(cache_path);
+        if (!file || file.size() < sizeof(Header)) return {};
+        const Header& header = *reinterpret_cast<const Header*>(file.data());
+        if (memcmp(header.magic, MAGIC, sizeof(MAGIC)) || header.version != VERSION || header.endian != ENDIAN
+            || header.key.source_size != k.source_size || header.key.source_time != k.source_time
+            || header.block_count != block_count)
+            return {};
+        for (size_t b = 0; b < block_count; ++b) {
+            if (header.offsets[b] % ALIGNMENT || header.offsets[b] + header.bytes[b] > file.size()) return {};
+        }
+        return file;
+    }
+
+    // size of block b of a cache returned by open, which the user checks against what it expects to find there
+    static uint64_t bytes(const MappedFile& file, const size_t b) {
+        return reinterpret_cast<const Header*>(file.data())->bytes[b];
+    }
+
+    // block b of a cache returned by open as an array of T, in place
+    template <typename T>
+    static std::span<const T> view(const MappedFile& file, const size_t b) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        const Header& header = *reinterpret_cast<const Header*>(file.data());
+        return {reinterpret_cast<const T*>(file.data() + header.offsets[b]), size_t(header.bytes[b] / sizeof(T))};
+    }
+
+private:
+    static uint64_t align(const uint64_t offset) {
+        return (offset + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+    }
+};
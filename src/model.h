@@ -1,61 +1,119 @@
 #pragma once
 
 #include <cmath>
+#include <bit>
 #include <tuple>
+#include <span>
 #include <vector>
 #include <string>
 #include <iostream>
-#include <sstream>
-#include <fstream>
 #include <array>
+#include <chrono>
 
 #include "types.h"
 #include "shapes.h"
+#include "bvh.h"
+#include "wide_bvh.h"
+#include "triangle_pack.h"
+#include "obj_loader.h"
+#include "mesh_cache.h"
 
-struct Model {
-    Material material;
-    std::vector<vec3f> vertices = {};
-    std::vector<int> facet_vrt = {}; 
+// what a hit on a face needs past the triangle packs, which hold the vertices the tests read: the index of the
+// face the record was made from and its unit normal
+struct alignas(16) TriangleRecord {
+    vec3f n;
+    uint32_t face;
+};
+static_assert(sizeof(TriangleRecord) == 16);
 
-    Model(const std::string& file_path, const Material& m) : material(m) {
-        std::ifstream file(file_path);
-        if (!file) {
-            std::cerr << "Can't load model " << file_path << std::endl;
-            return;
-        }
+// triangle mesh and its bvh, placed in a scene through instances.
+// the mesh arrays are views, either of the arrays parsed from the obj file or of a mapped binary cache of them
+// written next to it after the first parse
+struct Model {
+    std::span<const vec3f> vertices = {};
+    std::span<const int> facet_vrt = {};
+    // only filled in when the file has them, see ObjMesh
+    std::span<const vec3f> normals = {};
+    std::span<const vec2f> uvs = {};
+    std::span<const int> facet_nrm = {};
+    std::span<const int> facet_uv = {};
+    BVH bvh;
+    WideBVH<WideBVHNode<WIDE_BVH_WIDTH>> wide_bvh;
+    WideBVH<QuantizedBVHNode<WIDE_BVH_WIDTH>> quantized_bvh;
+    BVHLayout layout = BVHLayout::Wide;
+    AABB bounds;
+    // precomputed faces in the order of the bvh's primitive indices, which then index these rather than the faces.
+    // left empty when precompute is off, the primitives are then the faces and their normals are recomputed
+    bool precompute = true;
+    std::span<const TriangleRecord> triangles = {};
+    // the leaves' triangles, tested TRIANGLE_PACK_WIDTH at a time, and the first pack of the leaf starting at each
+    // primitive index. left empty when pack is off, by default in builds without the SIMD tests, the leaves'
+    // faces are then gathered through facet_vrt and tested one at a time
+    bool pack = TRIANGLE_PACK_SIMD;
+    std::span<const TrianglePack<TRIANGLE_PACK_WIDTH>> triangle_packs = {};
+    std::span<const uint32_t> leaf_packs = {};
+    // woop's watertight test in place of moller-trumbore, no ray slips through the edges shared by two faces
+    bool watertight = false;
 
-        std::string line;
-        while (std::getline(file, line)) {
-            if (line.empty() || line[0] == '#') continue;
+    Model(const std::string& file_path, const BVH::BuildMode mode = BVH::BuildMode::SAH,
+    const BVHLayout l = BVHLayout::Wide, const bool precompute_triangles = true, const bool pack_triangles = TRIANGLE_PACK_SIMD)
+    : layout(l), precompute(precompute_triangles), pack(pack_triangles) {
+        bvh.mode = mode;
 
-            std::istringstream iss(line);
+        const bool cached = load_cache(file_path);
+        if (!cached) {
+            if (!load_obj(file_path, parsed)) {
+                std::cerr << "Can't load model " << file_path << std::endl;
+                return;
+            }
+            view(parsed);
+        }
 
-            if (line.rfind("v ", 0) == 0) {
-                char v;
-                float x, y, z;
-                iss >> v >> x >> y >> z;
+        std::cout << vertices.size() << "vertices" << std::endl;
+        std::cout << facet_vrt.size() << "faces" << std::endl;
 
-                vec3f vertex = {
-                    x,
-                    y,
-                    z
-                };
-                vertices.emplace_back(vertex);
+        if (!cached || !load_cached_bvh()) {
+            build_bvh();
+            write_cache(file_path);
+        }
+    }
 
-            } else if (line.rfind("f ", 0) == 0) {
-                char f;
-                std::string v1, v2, v3;
-                iss >> f >> v1 >> v2 >> v3;
+    // the views point into the model
+    Model(const Model&) = delete;
+    Model& operator=(const Model&) = delete;
 
-                facet_vrt.push_back(std::stoi(v1) - 1);
-                facet_vrt.push_back(std::stoi(v2) - 1);
-                facet_vrt.push_back(std::stoi(v3) - 1);
-            } 
+    // returns the build time in milliseconds
+    double build_bvh() {
+        std::vector<AABB> face_bounds(nfaces());
+        bounds = AABB();
+        for (int f = 0; f < nfaces(); ++f) {
+            face_bounds[f].grow(vert(f, 0));
+            face_bounds[f].grow(vert(f, 1));
+            face_bounds[f].grow(vert(f, 2));
+            bounds.grow(face_bounds[f]);
         }
 
-        std::cout << vertices.size() << "vertices" << std::endl;
-        std::cout << facet_vrt.size() << "faces" << std::endl;
+        auto start = std::chrono::steady_clock::now();
+        bvh.leaf_width = pack ? TRIANGLE_PACK_WIDTH : 1;
+        bvh.build(face_bounds);
+        const size_t binary_nodes = bvh.nodes.size();
+        wide_bvh.clear();
+        quantized_bvh.clear();
+        if (layout == BVHLayout::Wide) wide_bvh.build(bvh);
+        if (layout == BVHLayout::Quantized) quantized_bvh.build(bvh);
+        // the binary tree is only a build intermediate for the wide layouts
+        if (layout != BVHLayout::Binary) bvh.clear();
+        build_triangles();
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
 
+        std::cout << binary_nodes << "bvh nodes built in " << elapsed.count() << "ms on " << bvh.threads << " threads ("
+            << (bvh.mode == BVH::BuildMode::LBVH ? "lbvh" : "sah");
+        if (layout == BVHLayout::Wide) std::cout << ", collapsed to " << wide_bvh.nodes.size() << " " << WIDE_BVH_WIDTH << "-wide nodes";
+        if (layout == BVHLayout::Quantized) std::cout << ", collapsed to " << quantized_bvh.nodes.size() << " quantized " << WIDE_BVH_WIDTH << "-wide nodes";
+        std::cout << ", " << bvh_bytes() / 1024 << "KiB";
+        if (triangle_bytes()) std::cout << ", " << triangle_bytes() / 1024 << "KiB of triangle records and packs";
+        std::cout << ")" << std::endl;
+        return elapsed.count();
     }
 
     inline int nverts() const { return vertices.size(); }
@@ -69,24 +127,207 @@ struct Model {
         return vertices[facet_vrt[iface*3+nthvert]];
     }
 
-    bool ray_intersect(const vec3f& origin, const vec3f& direction, const int i, float& t_dist) {
-        constexpr float EPSILON = 1e-5;
+    inline size_t bvh_bytes() const {
+        return bvh.memory_bytes() + wide_bvh.memory_bytes() + quantized_bvh.memory_bytes();
+    }
 
-        const vec3f v0 = vert(i, 0);
-        const vec3f v1 = vert(i, 1);
-        const vec3f v2 = vert(i, 2);
+    inline size_t triangle_bytes() const {
+        return triangles.size_bytes() + triangle_packs.size_bytes() + leaf_packs.size_bytes();
+    }
 
-        vec3f edge1 = v1 - v0;
-        vec3f edge2 = v2 - v0;
+    // a hit primitive's face index and unit normal, primitives being triangle records when there are any
+    inline int face(const int prim) const {
+        return triangles.empty() ? prim : int(triangles[prim].face);
+    }
+
+    inline vec3f normal(const int prim) const {
+        if (!triangles.empty()) return triangles[prim].n;
+        const vec3f v0 = vert(prim, 0);
+        return cross(vert(prim, 1) - v0, vert(prim, 2) - v0).normalize();
+    }
+
+    // closest hit over all faces, t_dist is both the search limit and the result. prim is the primitive hit, see face()
+    bool intersect(const vec3f& origin, const vec3f& direction, float& t_dist, int& prim) const {
+        const WatertightRay ray(origin, direction);
+        const WatertightRay* sheared = watertight ? &ray : nullptr;
+        if (!triangle_packs.empty()) {
+            auto intersect_leaf = [&](const uint32_t first, const uint32_t count, float& t_max) {
+                bool hit = false;
+                for (uint32_t p = leaf_packs[first], end = p + packs(count); p < end; ++p) {
+                    float t;
+                    const int slot = sheared ? triangle_packs[p].intersect(ray, t_max, t)
+                        : triangle_packs[p].intersect(origin, direction, t_max, t);
+                    if (slot < 0) continue;
+                    t_max = t;
+                    prim = triangle_packs[p].prim[slot];
+                    hit = true;
+                }
+                return hit;
+            };
+            switch (layout) {
+                case BVHLayout::Wide:      return wide_bvh.intersect_leaves(origin, direction, t_dist, intersect_leaf);
+                case BVHLayout::Quantized: return quantized_bvh.intersect_leaves(origin, direction, t_dist, intersect_leaf);
+                default:                   return bvh.intersect_leaves(origin, direction, t_dist, intersect_leaf);
+            }
+        }
+        auto intersect_face = [&](const uint32_t p, float& t_max) {
+            float t;
+            if (ray_intersect(origin, direction, p, t, sheared) && t < t_max) {
+                t_max = t;
+                prim = p;
+                return true;
+            }
+            return false;
+        };
+        switch (layout) {
+            case BVHLayout::Wide:      return wide_bvh.intersect(origin, direction, t_dist, intersect_face);
+            case BVHLayout::Quantized: return quantized_bvh.intersect(origin, direction, t_dist, intersect_face);
+            default:                   return bvh.intersect(origin, direction, t_dist, intersect_face);
+        }
+    }
+
+    // whether any face is hit closer than t_max
+    bool occluded(const vec3f& origin, const vec3f& direction, const float t_max) const {
+        const WatertightRay ray(origin, direction);
+        const WatertightRay* sheared = watertight ? &ray : nullptr;
+        if (!triangle_packs.empty()) {
+            auto occluded_leaf = [&](const uint32_t first, const uint32_t count, float) {
+                float t;
+                for (uint32_t p = leaf_packs[first], end = p + packs(count); p < end; ++p) {
+                    const int slot = sheared ? triangle_packs[p].intersect(ray, t_max, t)
+                        : triangle_packs[p].intersect(origin, direction, t_max, t);
+                    if (slot >= 0) return true;
+                }
+                return false;
+            };
+            switch (layout) {
+                case BVHLayout::Wide:      return wide_bvh.occluded_leaves(origin, direction, t_max, occluded_leaf);
+                case BVHLayout::Quantized: return quantized_bvh.occluded_leaves(origin, direction, t_max, occluded_leaf);
+                default:                   return bvh.occluded_leaves(origin, direction, t_max, occluded_leaf);
+            }
+        }
+        auto occluded_face = [&](const uint32_t p, float) {
+            float t;
+            return ray_intersect(origin, direction, p, t, sheared) && t < t_max;
+        };
+        switch (layout) {
+            case BVHLayout::Wide:      return wide_bvh.occluded(origin, direction, t_max, occluded_face);
+            case BVHLayout::Quantized: return quantized_bvh.occluded(origin, direction, t_max, occluded_face);
+            default:                   return bvh.occluded(origin, direction, t_max, occluded_face);
+        }
+    }
+
+    // the packet versions, for the active lanes: intersect shrinks t_dist[lane] and sets prim[lane] for the lanes
+    // it returns as hit, occluded returns the lanes with a face closer than their t_max
+    uint32_t intersect(const RayPacket& packet, const uint32_t active, float* t_dist, int* prim) const {
+        WatertightRay rays[RayPacket::N];
+        if (watertight)
+            for (uint32_t mask = active; mask; mask &= mask - 1) {
+                const int lane = std::countr_zero(mask);
+                rays[lane] = WatertightRay(packet.origin(lane), packet.direction(lane));
+            }
+        auto intersect_leaf = [&](const uint32_t first, const uint32_t count, const uint32_t lanes) {
+            uint32_t hit = 0;
+            for (uint32_t mask = lanes; mask; mask &= mask - 1) {
+                const int lane = std::countr_zero(mask);
+                const vec3f origin = packet.origin(lane);
+                const vec3f direction = packet.direction(lane);
+                float& t_max = t_dist[lane];
+                if (!triangle_packs.empty()) {
+                    for (uint32_t p = leaf_packs[first], end = p + packs(count); p < end; ++p) {
+                        float t;
+                        const int slot = watertight ? triangle_packs[p].intersect(rays[lane], t_max, t)
+                            : triangle_packs[p].intersect(origin, direction, t_max, t);
+                        if (slot < 0) continue;
+                        t_max = t;
+                        prim[lane] = triangle_packs[p].prim[slot];
+                        hit |= 1u << lane;
+                    }
+                    continue;
+                }
+                for (uint32_t i = first; i < first + count; ++i) {
+                    const uint32_t p = prim_indices()[i];
+                    float t;
+                    if (ray_intersect(origin, direction, p, t, watertight ? &rays[lane] : nullptr) && t < t_max) {
+                        t_max = t;
+                        prim[lane] = p;
+                        hit |= 1u << lane;
+                    }
+                }
+            }
+            return hit;
+        };
+        switch (layout) {
+            case BVHLayout::Wide:      return wide_bvh.intersect_packet(packet, active, t_dist, intersect_leaf);
+            case BVHLayout::Quantized: return quantized_bvh.intersect_packet(packet, active, t_dist, intersect_leaf);
+            default:                   return bvh.intersect_packet(packet, active, t_dist, intersect_leaf);
+        }
+    }
+
+    uint32_t occluded(const RayPacket& packet, const uint32_t active, const float* t_max) const {
+        WatertightRay rays[RayPacket::N];
+        if (watertight)
+            for (uint32_t mask = active; mask; mask &= mask - 1) {
+                const int lane = std::countr_zero(mask);
+                rays[lane] = WatertightRay(packet.origin(lane), packet.direction(lane));
+            }
+        auto occluded_leaf = [&](const uint32_t first, const uint32_t count, const uint32_t lanes) {
+            uint32_t hit = 0;
+            for (uint32_t mask = lanes; mask; mask &= mask - 1) {
+                const int lane = std::countr_zero(mask);
+                const vec3f origin = packet.origin(lane);
+                const vec3f direction = packet.direction(lane);
+                float t;
+                if (!triangle_packs.empty()) {
+                    for (uint32_t p = leaf_packs[first], end = p + packs(count); p < end; ++p) {
+                        const int slot = watertight ? triangle_packs[p].intersect(rays[lane], t_max[lane], t)
+                            : triangle_packs[p].intersect(origin, direction, t_max[lane], t);
+                        if (slot >= 0) {
+                            hit |= 1u << lane;
+                            break;
+                        }
+                    }
+                    continue;
+                }
+                for (uint32_t i = first; i < first + count; ++i) {
+                    if (ray_intersect(origin, direction, prim_indices()[i], t, watertight ? &rays[lane] : nullptr) && t < t_max[lane]) {
+                        hit |= 1u << lane;
+                        break;
+                    }
+                }
+            }
+            return hit;
+        };
+        switch (layout) {
+            case BVHLayout::Wide:      return wide_bvh.occluded_packet(packet, active, t_max, occluded_leaf);
+            case BVHLayout::Quantized: return quantized_bvh.occluded_packet(packet, active, t_max, occluded_leaf);
+            default:                   return bvh.occluded_packet(packet, active, t_max, occluded_leaf);
+        }
+    }
+
+    // tests a primitive, with the watertight test when given the sheared ray
+    bool ray_intersect(const vec3f& origin, const vec3f& direction, const int prim, float& t_dist,
+    const WatertightRay* sheared = nullptr) const {
+        const int f = face(prim);
+        if (sheared) return ray_intersect_watertight(*sheared, vert(f, 0), vert(f, 1), vert(f, 2), t_dist);
+        const vec3f v0 = vert(f, 0);
+        return ray_intersect(origin, direction, v0, vert(f, 1) - v0, vert(f, 2) - v0, t_dist);
+    }
+
+    static bool ray_intersect(const vec3f& origin, const vec3f& direction, const vec3f& v0, const vec3f& edge1,
+    const vec3f& edge2, float& t_dist) {
+        constexpr float EPSILON = TRIANGLE_EPSILON;
 
         vec3f pvec = cross(direction, edge2);
-        float a = fabs(edge1 * pvec);
+        float det = edge1 * pvec;
+        float a = fabs(det);
 
         if (a < EPSILON) {
             return false;
         }
 
-        vec3f tvec = origin - v0;
+        // flipping tvec for back faces keeps u, v and t in the same scale as a
+        vec3f tvec = det < 0 ? v0 - origin : origin - v0;
         float u = tvec*pvec;
         if (u < 0 || u > a) return false;
 
@@ -102,4 +343,235 @@ struct Model {
         
         return false;
     }
-};
\ No newline at end of file
+
+private:
+    enum CacheBlock { VERTICES, NORMALS, UVS, FACET_VRT, FACET_NRM, FACET_UV, BVH_INFO, BVH_NODES, BVH_PRIMS, TRIANGLES, TRIANGLE_PACKS,
+        LEAF_PACKS, CACHE_BLOCKS };
+
+    // what the cached bvh was built as, a cache holding another one gets its bvh rebuilt and replaced
+    struct CachedBVH {
+        uint32_t format; // CACHE_FORMAT
+        uint32_t mode, layout, width, node_bytes;
+        uint32_t triangles; // whether the primitive indices index triangle records
+        uint32_t packed;    // whether the leaves have triangle packs
+        uint32_t pack_width;
+        uint32_t nodes, packs; // in BVH_NODES and TRIANGLE_PACKS
+        AABB bounds;
+    };
+    static constexpr uint32_t CACHE_FORMAT = 8; // bumped when the blocks change
+
+    ObjMesh parsed;         // backs the views after parsing
+    MappedFile cache_file;  // backs them when loaded from the cache
+    std::vector<TriangleRecord> triangle_store; // backs triangles when built here rather than mapped
+    std::vector<TrianglePack<TRIANGLE_PACK_WIDTH>> pack_store; // same for triangle_packs
+    std::vector<uint32_t> leaf_pack_store;                     // and for leaf_packs
+
+    static inline uint32_t packs(const uint32_t count) {
+        return (count + TRIANGLE_PACK_WIDTH - 1) / TRIANGLE_PACK_WIDTH;
+    }
+
+    template <typename F>
+    void for_each_leaf(F&& f) const {
+        switch (layout) {
+            case BVHLayout::Wide:      wide_bvh.for_each_leaf(f); break;
+            case BVHLayout::Quantized: quantized_bvh.for_each_leaf(f); break;
+            default:                   bvh.for_each_leaf(f); break;
+        }
+    }
+
+    // the primitive indices of a bvh built here, which the records replace in place
+    std::vector<uint32_t>& prim_store() {
+        switch (layout) {
+            case BVHLayout::Wide:      return wide_bvh.prim_store;
+            case BVHLayout::Quantized: return quantized_bvh.prim_store;
+            default:                   return bvh.prim_store;
+        }
+    }
+
+    std::span<const uint32_t> prim_indices() const {
+        switch (layout) {
+            case BVHLayout::Wide:      return wide_bvh.prim_indices;
+            case BVHLayout::Quantized: return quantized_bvh.prim_indices;
+            default:                   return bvh.prim_indices;
+        }
+    }
+
+    // lays the faces out in the order the bvh leaves list them and points the leaves at the records instead, then
+    // packs each leaf's faces, with the leaves' primitives in the slots whether those are records or faces
+    void build_triangles() {
+        triangle_store = {};
+        pack_store = {};
+        leaf_pack_store = {};
+        triangles = {};
+        triangle_packs = {};
+        leaf_packs = {};
+        std::vector<uint32_t>& prims = prim_store();
+        if (precompute) {
+            triangle_store.resize(prims.size());
+            for (size_t p = 0; p < prims.size(); ++p) {
+                TriangleRecord& tri = triangle_store[p];
+                const int f = prims[p];
+                const vec3f v0 = vert(f, 0);
+                tri.n = cross(vert(f, 1) - v0, vert(f, 2) - v0).normalize();
+                tri.face = f;
+                prims[p] = p;
+            }
+            triangles = triangle_store;
+        }
+        if (!pack) return;
+
+        leaf_pack_store.resize(prims.size());
+        for_each_leaf([&](const uint32_t first, const uint32_t count) {
+            leaf_pack_store[first] = pack_store.size();
+            pack_store.resize(pack_store.size() + packs(count));
+            TrianglePack<TRIANGLE_PACK_WIDTH>* leaf = pack_store.data() + leaf_pack_store[first];
+            // the slots past the leaf's faces stay zero and unused
+            for (uint32_t i = 0; i < count; ++i) {
+                const uint32_t p = prims[first + i];
+                const int f = face(p);
+                leaf[i / TRIANGLE_PACK_WIDTH].set(i % TRIANGLE_PACK_WIDTH, vert(f, 0), vert(f, 1), vert(f, 2), p);
+            }
+        });
+        triangle_packs = pack_store;
+        leaf_packs = leaf_pack_store;
+    }
+
+    // whether the records name faces of the mesh, every leaf's packs lie within triangle_packs and their used slots
+    // name primitives, the checks load_cached_bvh needs past the bvh's own. records and faces are as many
+    bool valid_triangles() const {
+        for (const TriangleRecord& tri : triangles) if (tri.face >= uint32_t(nfaces())) return false;
+        for (const TrianglePack<TRIANGLE_PACK_WIDTH>& leaf : triangle_packs) {
+            if (leaf.count > TRIANGLE_PACK_WIDTH) return false;
+            for (uint32_t i = 0; i < leaf.count; ++i) if (leaf.prim[i] >= uint32_t(nfaces())) return false;
+        }
+        bool valid = true;
+        if (!leaf_packs.empty()) for_each_leaf([&](const uint32_t first, const uint32_t count) {
+            valid = valid && first < leaf_packs.size() && uint64_t(leaf_packs[first]) + packs(count) <= triangle_packs.size();
+        });
+        return valid;
+    }
+
+    void view(const ObjMesh& mesh) {
+        vertices = mesh.vertices;
+        normals = mesh.normals;
+        uvs = mesh.uvs;
+        facet_vrt = mesh.facet_vrt;
+        facet_nrm = mesh.facet_nrm;
+        facet_uv = mesh.facet_uv;
+    }
+
+    CachedBVH cached_bvh() const {
+        const size_t node_bytes = layout == BVHLayout::Wide ? sizeof(wide_bvh.nodes[0])
+            : layout == BVHLayout::Quantized ? sizeof(quantized_bvh.nodes[0]) : sizeof(BVHNode);
+        const size_t nodes = layout == BVHLayout::Wide ? wide_bvh.nodes.size()
+            : layout == BVHLayout::Quantized ? quantized_bvh.nodes.size() : bvh.nodes.size();
+        return {CACHE_FORMAT, uint32_t(bvh.mode), uint32_t(layout), uint32_t(WIDE_BVH_WIDTH), uint32_t(node_bytes), precompute,
+            pack, uint32_t(TRIANGLE_PACK_WIDTH), uint32_t(nodes), uint32_t(triangle_packs.size()), bounds};
+    }
+
+    // writes the mesh together with the bvh of the current layout
+    void write_cache(const std::string& file_path) const {
+        MeshCache::Key key;
+        if (!MeshCache::key(file_path, key)) return;
+        const CachedBVH info = cached_bvh();
+        MeshCache::Block blocks[CACHE_BLOCKS] = {
+            MeshCache::block(vertices), MeshCache::block(normals), MeshCache::block(uvs),
+            MeshCache::block(facet_vrt), MeshCache::block(facet_nrm), MeshCache::block(facet_uv),
+            {&info, sizeof(info)}, MeshCache::block(bvh.nodes), MeshCache::block(bvh.prim_indices), MeshCache::block(triangles),
+            MeshCache::block(triangle_packs), MeshCache::block(leaf_packs)};
+        if (layout == BVHLayout::Wide) {
+            blocks[BVH_NODES] = MeshCache::block(wide_bvh.nodes);
+            blocks[BVH_PRIMS] = MeshCache::block(wide_bvh.prim_indices);
+        } else if (layout == BVHLayout::Quantized) {
+            blocks[BVH_NODES] = MeshCache::block(quantized_bvh.nodes);
+            blocks[BVH_PRIMS] = MeshCache::block(quantized_bvh.prim_indices);
+        }
+        MeshCache::write(file_path + ".cache", key, blocks);
+    }
+
+    bool load_cache(const std::string& file_path) {
+        auto start = std::chrono::steady_clock::now();
+        MeshCache::Key key;
+        if (!MeshCache::key(file_path, key)) return false;
+        cache_file = MeshCache::open(file_path + ".cache", key, CACHE_BLOCKS);
+        if (!cache_file) return false;
+
+        vertices = MeshCache::view<vec3f>(cache_file, VERTICES);
+        normals = MeshCache::view<vec3f>(cache_file, NORMALS);
+        uvs = MeshCache::view<vec2f>(cache_file, UVS);
+        facet_vrt = MeshCache::view<int>(cache_file, FACET_VRT);
+        facet_nrm = MeshCache::view<int>(cache_file, FACET_NRM);
+        facet_uv = MeshCache::view<int>(cache_file, FACET_UV);
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << cache_file.size() / 1e6 << "MB mesh cache mapped in " << elapsed.count() << "ms" << std::endl;
+        return true;
+    }
+
+    // the bvh, the triangle records and the packs are all used in place in the mapping. false when the cache holds a
+    // bvh of another build mode or layout, the records and packs don't match the settings, or the blocks don't hold
+    // what the info says or indices that stay within them: the traversal reads them unchecked, a damaged cache has
+    // its bvh rebuilt rather than crashing the render
+    bool load_cached_bvh() {
+        auto start = std::chrono::steady_clock::now();
+        const std::span<const CachedBVH> info = MeshCache::view<CachedBVH>(cache_file, BVH_INFO);
+        const CachedBVH expected = cached_bvh();
+        if (MeshCache::bytes(cache_file, BVH_INFO) != sizeof(CachedBVH) || info[0].format != expected.format
+            || info[0].mode != expected.mode || info[0].layout != expected.layout || info[0].width != expected.width
+            || info[0].node_bytes != expected.node_bytes || info[0].triangles != expected.triangles
+            || info[0].packed != expected.packed || info[0].pack_width != expected.pack_width)
+            return false;
+        const uint64_t records = precompute ? nfaces() : 0, leaves = pack ? nfaces() : 0;
+        if (MeshCache::bytes(cache_file, BVH_NODES) != uint64_t(info[0].nodes) * info[0].node_bytes
+            || MeshCache::bytes(cache_file, BVH_PRIMS) != uint64_t(nfaces()) * sizeof(uint32_t)
+            || MeshCache::bytes(cache_file, TRIANGLES) != records * sizeof(TriangleRecord)
+            || MeshCache::bytes(cache_file, TRIANGLE_PACKS) != uint64_t(info[0].packs) * sizeof(TrianglePack<TRIANGLE_PACK_WIDTH>)
+            || MeshCache::bytes(cache_file, LEAF_PACKS) != leaves * sizeof(uint32_t))
+            return false;
+
+        wide_bvh.clear();
+        quantized_bvh.clear();
+        bvh.clear();
+        const std::span<const uint32_t> prims = MeshCache::view<uint32_t>(cache_file, BVH_PRIMS);
+        size_t nodes = 0;
+        switch (layout) {
+            case BVHLayout::Wide:
+                wide_bvh.view(MeshCache::view<WideBVHNode<WIDE_BVH_WIDTH>>(cache_file, BVH_NODES), prims);
+                nodes = wide_bvh.nodes.size();
+                break;
+            case BVHLayout::Quantized:
+                quantized_bvh.view(MeshCache::view<QuantizedBVHNode<WIDE_BVH_WIDTH>>(cache_file, BVH_NODES), prims);
+                nodes = quantized_bvh.nodes.size();
+                break;
+            default:
+                bvh.view(MeshCache::view<BVHNode>(cache_file, BVH_NODES), prims);
+                nodes = bvh.nodes.size();
+                break;
+        }
+        triangle_store = {};
+        pack_store = {};
+        leaf_pack_store = {};
+        triangles = MeshCache::view<TriangleRecord>(cache_file, TRIANGLES);
+        triangle_packs = MeshCache::view<TrianglePack<TRIANGLE_PACK_WIDTH>>(cache_file, TRIANGLE_PACKS);
+        leaf_packs = MeshCache::view<uint32_t>(cache_file, LEAF_PACKS);
+        const bool valid = layout == BVHLayout::Wide ? wide_bvh.valid(nfaces())
+            : layout == BVHLayout::Quantized ? quantized_bvh.valid(nfaces()) : bvh.valid(nfaces());
+        if (!valid || !valid_triangles()) {
+            wide_bvh.clear();
+            quantized_bvh.clear();
+            bvh.clear();
+            triangles = {};
+            triangle_packs = {};
+            leaf_packs = {};
+            return false;
+        }
+        bounds = info[0].bounds;
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+        std::cout << nodes << (layout == BVHLayout::Binary ? "" : layout == BVHLayout::Wide ? " wide" : " quantized")
+            << " bvh nodes mapped from the cache in " << elapsed.count() << "ms (" << (bvh.mode == BVH::BuildMode::LBVH ? "lbvh" : "sah")
+            << ", " << bvh_bytes() / 1024 << "KiB";
+        if (triangle_bytes()) std::cout << ", " << triangle_bytes() / 1024 << "KiB of triangle records and packs";
+        std::cout << ")" << std::endl;
+        return true;
+    }
+};
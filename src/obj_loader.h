@@ -0,0 +1,286 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <charconv>
+#include <algorithm>
+
+#include "types.h"
+#include "mapped_file.h"
+#include "parallel.h"
+
+// vertices and triangles of a wavefront obj file, polygons being split into fans
+struct ObjMesh {
+    std::vector<vec3f> vertices = {};
+    std::vector<vec3f> normals = {};
+    std::vector<vec2f> uvs = {};
+    std::vector<int> facet_vrt = {}; // three vertex indices per triangle
+    // normal and texture coordinate indices per corner like facet_vrt, -1 for corners without one and
+    // left empty when no face has any
+    std::vector<int> facet_nrm = {};
+    std::vector<int> facet_uv = {};
+};
+
+// parses obj text in place with std::from_chars, nothing is allocated besides the growth of the mesh arrays.
+// lines that fail to parse are skipped and counted.
+// negative indices count back from the latest element of their kind. as a chunk doesn't know how many elements
+// the chunks before it have, they are resolved against the chunk's own arrays and their positions in the facet
+// arrays are kept in relative so that the offsets of the earlier chunks can be added when merging
+struct ObjParser {
+    enum Attribute { VERTEX, NORMAL, UV };
+
+    const char* p;
+    const char* end;
+    ObjMesh& mesh;
+    size_t malformed = 0;
+    const char* first_malformed = nullptr;
+    std::vector<size_t> relative[3] = {}; // per attribute
+
+    ObjParser(const char* begin, const char* e, ObjMesh& m) : p(begin), end(e), mesh(m) {}
+
+    void parse() {
+        while (p < end) {
+            const char* line = p;
+            if (!parse_line()) {
+                if (!malformed++) first_malformed = line;
+            }
+            next_line();
+        }
+    }
+
+private:
+    struct Corner {
+        int index[3];
+        bool present[3];
+        bool relative[3];
+    };
+
+    static bool blank(const char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+    bool line_end() const { return p == end || *p == '\n' || *p == '#'; }
+
+    void skip_blanks() { while (p < end && blank(*p)) ++p; }
+
+    void next_line() {
+        const char* eol = static_cast<const char*>(memchr(p, '\n', end - p));
+        p = eol ? eol + 1 : end;
+    }
+
+    // keyword followed by a blank
+    bool keyword(const char* word, const size_t n) {
+        if (size_t(end - p) <= n || memcmp(p, word, n) || !blank(p[n])) return false;
+        p += n;
+        return true;
+    }
+
+    bool parse_float(float& value) {
+        skip_blanks();
+        if (p < end && *p == '+') ++p; // from_chars doesn't take a plus sign
+        const auto [next, error] = std::from_chars(p, end, value);
+        if (error != std::errc()) return false;
+        p = next;
+        return true;
+    }
+
+    // one based or negative index into the elements of a kind parsed so far, made zero based
+    bool parse_index(Corner& corner, const Attribute a, const size_t count) {
+        int value;
+        const auto [next, error] = std::from_chars(p, end, value);
+        if (error != std::errc() || value == 0) return false;
+        p = next;
+        corner.present[a] = true;
+        corner.relative[a] = value < 0;
+        corner.index[a] = value < 0 ? int(count) + value : value - 1;
+        return true;
+    }
+
+    // v, v/vt, v//vn or v/vt/vn
+    bool parse_corner(Corner& corner) {
+        corner.present[NORMAL] = corner.present[UV] = false;
+        if (!parse_index(corner, VERTEX, mesh.vertices.size())) return false;
+        if (p < end && *p == '/') {
+            ++p;
+            if (p < end && *p != '/' && !parse_index(corner, UV, mesh.uvs.size())) return false;
+            if (p < end && *p == '/') {
+                ++p;
+                if (!parse_index(corner, NORMAL, mesh.normals.size())) return false;
+            }
+        }
+        return p == end || blank(*p) || *p == '\n';
+    }
+
+    void push(std::vector<int>& facet, const Attribute a, const Corner& corner) {
+        if (corner.present[a] && corner.relative[a]) relative[a].push_back(facet.size());
+        facet.push_back(corner.present[a] ? corner.index[a] : -1);
+    }
+
+    void push_triangle(const Corner& a, const Corner& b, const Corner& c) {
+        const size_t base = mesh.facet_vrt.size();
+        for (const Corner* corner : {&a, &b, &c}) push(mesh.facet_vrt, VERTEX, *corner);
+        for (const Attribute attribute : {NORMAL, UV}) {
+            std::vector<int>& facet = attribute == NORMAL ? mesh.facet_nrm : mesh.facet_uv;
+            if (facet.empty() && !a.present[attribute] && !b.present[attribute] && !c.present[attribute]) continue;
+            facet.resize(base, -1); // the first face with the attribute fills in the ones before it
+            for (const Corner* corner : {&a, &b, &c}) push(facet, attribute, *corner);
+        }
+    }
+
+    bool parse_line() {
+        skip_blanks();
+        if (line_end()) return true;
+
+        if (keyword("v", 1)) {
+            vec3f v;
+            if (!parse_float(v.x) || !parse_float(v.y) || !parse_float(v.z)) return false;
+            mesh.vertices.push_back(v);
+        } else if (keyword("vn", 2)) {
+            vec3f n;
+            if (!parse_float(n.x) || !parse_float(n.y) || !parse_float(n.z)) return false;
+            mesh.normals.push_back(n);
+        } else if (keyword("vt", 2)) {
+            vec2f uv;
+            if (!parse_float(uv.x)) return false;
+            skip_blanks();
+            if (!line_end() && !parse_float(uv.y)) return false; // an optional w after v is ignored
+            mesh.uvs.push_back(uv);
+        } else if (keyword("f", 1)) {
+            // polygons are fanned out from their first corner as they are read
+            const size_t sizes[] = {mesh.facet_vrt.size(), mesh.facet_nrm.size(), mesh.facet_uv.size(),
+                relative[VERTEX].size(), relative[NORMAL].size(), relative[UV].size()};
+            Corner first, previous, current;
+            int corners = 0;
+            for (skip_blanks(); !line_end(); skip_blanks(), ++corners) {
+                if (!parse_corner(current)) {
+                    // drops the triangles of the line that were already emitted
+                    mesh.facet_vrt.resize(sizes[0]);
+                    mesh.facet_nrm.resize(sizes[1]);
+                    mesh.facet_uv.resize(sizes[2]);
+                    for (int a = 0; a < 3; ++a) relative[a].resize(sizes[3 + a]);
+                    return false;
+                }
+                if (corners >= 2) push_triangle(first, previous, current);
+                (corners ? previous : first) = current;
+            }
+            return corners >= 3;
+        }
+        // other statements (groups, materials, smoothing) are ignored
+        return true;
+    }
+};
+
+// files are split into newline aligned chunks of at least this many bytes, parsed on their own threads
+constexpr size_t OBJ_MIN_CHUNK = 1 << 20;
+
+// maps the file and parses it on up to thread_count threads, false when it can't be read
+inline bool load_obj(const std::string& path, ObjMesh& mesh) {
+    auto start = std::chrono::steady_clock::now();
+    MappedFile file(path);
+    if (!file) return false;
+    const char* const begin = file.data();
+    const char* const end = begin + file.size();
+
+    // chunk c covers [bounds[c], bounds[c + 1]), every bound but the first one lies just past a newline
+    const size_t chunks = std::max<size_t>(1, std::min<size_t>(thread_count, file.size() / OBJ_MIN_CHUNK));
+    std::vector<const char*> bounds(chunks + 1, end);
+    bounds[0] = begin;
+    for (size_t c = 1; c < chunks; ++c) {
+        const char* p = std::max(bounds[c - 1], begin + file.size() * c / chunks);
+        const char* eol = p < end ? static_cast<const char*>(memchr(p, '\n', end - p)) : nullptr;
+        bounds[c] = eol ? eol + 1 : end;
+    }
+
+    std::vector<ObjMesh> parts(chunks);
+    std::vector<ObjParser> parsers;
+    parsers.reserve(chunks);
+    for (size_t c = 0; c < chunks; ++c) parsers.emplace_back(bounds[c], bounds[c + 1], parts[c]);
+    parallel_chunks(chunks, chunks, [&](const size_t c, size_t, size_t) { parsers[c].parse(); });
+
+    // the parts are laid end to end, the indices resolved against a part's own arrays being moved by the number
+    // of elements in the parts before it
+    std::vector<size_t> offsets[3], index_offsets(chunks + 1, 0);
+    for (auto& o : offsets) o.assign(chunks + 1, 0);
+    bool has_normals = false, has_uvs = false;
+    for (size_t c = 0; c < chunks; ++c) {
+        offsets[ObjParser::VERTEX][c + 1] = offsets[ObjParser::VERTEX][c] + parts[c].vertices.size();
+        offsets[ObjParser::NORMAL][c + 1] = offsets[ObjParser::NORMAL][c] + parts[c].normals.size();
+        offsets[ObjParser::UV][c + 1] = offsets[ObjParser::UV][c] + parts[c].uvs.size();
+        index_offsets[c + 1] = index_offsets[c] + parts[c].facet_vrt.size();
+        has_normals |= !parts[c].facet_nrm.empty();
+        has_uvs |= !parts[c].facet_uv.empty();
+    }
+    if (chunks == 1) {
+        mesh = std::move(parts[0]);
+    } else {
+        mesh.vertices.resize(offsets[ObjParser::VERTEX][chunks]);
+        mesh.normals.resize(offsets[ObjParser::NORMAL][chunks]);
+        mesh.uvs.resize(offsets[ObjParser::UV][chunks]);
+        mesh.facet_vrt.resize(index_offsets[chunks]);
+        mesh.facet_nrm.resize(has_normals ? index_offsets[chunks] : 0);
+        mesh.facet_uv.resize(has_uvs ? index_offsets[chunks] : 0);
+        parallel_chunks(chunks, chunks, [&](const size_t c, size_t, size_t) {
+            ObjMesh& part = parts[c];
+            std::copy(part.vertices.begin(), part.vertices.end(), mesh.vertices.begin() + offsets[ObjParser::VERTEX][c]);
+            std::copy(part.normals.begin(), part.normals.end(), mesh.normals.begin() + offsets[ObjParser::NORMAL][c]);
+            std::copy(part.uvs.begin(), part.uvs.end(), mesh.uvs.begin() + offsets[ObjParser::UV][c]);
+
+            auto merge = [&](std::vector<int>& facet, const std::vector<int>& part_facet, const ObjParser::Attribute a) {
+                if (facet.empty()) return;
+                auto out = facet.begin() + index_offsets[c];
+                if (part_facet.empty()) std::fill(out, out + part.facet_vrt.size(), -1);
+                else std::copy(part_facet.begin(), part_facet.end(), out);
+                for (const size_t i : parsers[c].relative[a]) out[i] += int(offsets[a][c]);
+            };
+            merge(mesh.facet_vrt, part.facet_vrt, ObjParser::VERTEX);
+            merge(mesh.facet_nrm, part.facet_nrm, ObjParser::NORMAL);
+            merge(mesh.facet_uv, part.facet_uv, ObjParser::UV);
+            part = {};
+        });
+    }
+
+    // triangles pointing past the arrays would crash the renderer later on
+    size_t out_of_range = 0, kept = 0;
+    const int counts[] = {int(mesh.vertices.size()), int(mesh.normals.size()), int(mesh.uvs.size())};
+    for (size_t t = 0; t < mesh.facet_vrt.size(); t += 3) {
+        bool valid = true;
+        for (size_t k = t; k < t + 3; ++k) {
+            valid &= mesh.facet_vrt[k] >= 0 && mesh.facet_vrt[k] < counts[0];
+            if (!mesh.facet_nrm.empty()) valid &= mesh.facet_nrm[k] >= -1 && mesh.facet_nrm[k] < counts[1];
+            if (!mesh.facet_uv.empty()) valid &= mesh.facet_uv[k] >= -1 && mesh.facet_uv[k] < counts[2];
+        }
+        if (!valid) {
+            ++out_of_range;
+            continue;
+        }
+        if (kept != t) {
+            for (size_t k = 0; k < 3; ++k) {
+                mesh.facet_vrt[kept + k] = mesh.facet_vrt[t + k];
+                if (!mesh.facet_nrm.empty()) mesh.facet_nrm[kept + k] = mesh.facet_nrm[t + k];
+                if (!mesh.facet_uv.empty()) mesh.facet_uv[kept + k] = mesh.facet_uv[t + k];
+            }
+        }
+        kept += 3;
+    }
+    mesh.facet_vrt.resize(kept);
+    if (!mesh.facet_nrm.empty()) mesh.facet_nrm.resize(kept);
+    if (!mesh.facet_uv.empty()) mesh.facet_uv.resize(kept);
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+    size_t malformed = 0;
+    const char* first_malformed = nullptr;
+    for (const ObjParser& parser : parsers) {
+        if (parser.malformed && !first_malformed) first_malformed = parser.first_malformed;
+        malformed += parser.malformed;
+    }
+    if (malformed) {
+        const size_t line = std::count(begin, first_malformed, '\n') + 1;
+        std::cerr << path << ": skipped " << malformed << " malformed lines, the first one being line " << line << std::endl;
+    }
+    if (out_of_range) std::cerr << path << ": skipped " << out_of_range << " triangles with out of range indices" << std::endl;
+    const double mb = file.size() / 1e6;
+    std::cout << mb << "MB of obj parsed in " << elapsed.count() << "ms on " << chunks << " threads ("
+        << mb / (elapsed.count() * 1e-3) << "MB/s)" << std::endl;
+    return true;
+}
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <cstddef>
+#include <algorithm>
+#include <functional>
+#include <condition_variable>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+inline unsigned hardware_threads() {
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// number of threads used for rendering and by bvh builders created afterwards, set with --threads
+inline unsigned thread_count = hardware_threads();
+
+// splits [0, n) into at most `chunks` contiguous ranges and runs f(chunk, begin, end) for each on its own thread,
+// returns the number of chunks actually used
+template <typename F>
+size_t parallel_chunks(const size_t n, size_t chunks, F&& f) {
+    chunks = std::max<size_t>(1, std::min(chunks, n));
+    const size_t step = (n + chunks - 1) / chunks;
+    chunks = (n + step - 1) / step;
+
+    std::vector<std::thread> workers;
+    workers.reserve(chunks - 1);
+    for (size_t c = 1; c < chunks; ++c)
+        workers.emplace_back([&, c] { f(c, c*step, std::min(n, (c + 1)*step)); });
+    f(size_t(0), size_t(0), std::min(n, step));
+    for (auto& w : workers) w.join();
+
+    return chunks;
+}
+
+// persistent workers that all run the same job, used for rendering when openmp isn't available
+class ThreadPool {
+public:
+    static ThreadPool& instance() {
+        static ThreadPool pool;
+        return pool;
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        wake.notify_all();
+        for (auto& w : workers) w.join();
+    }
+
+    // runs job(thread) on `threads` threads, the calling one being thread 0, and waits until all of them return.
+    // a run started from inside a job would wait on workers busy with the outer one, it calls the job for every
+    // thread index in turn on the calling thread instead
+    void run(const unsigned threads, const std::function<void(unsigned)>& job) {
+        if (in_job) {
+            for (unsigned t = 0; t < threads; ++t) job(t);
+            return;
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        while (workers.size() + 1 < threads)
+            workers.emplace_back(&ThreadPool::worker_loop, this, unsigned(workers.size()), generation);
+        current = &job;
+        wanted = threads - 1;
+        finished = 0;
+        ++generation;
+        lock.unlock();
+        wake.notify_all();
+
+        in_job = true;
+        job(0);
+        in_job = false;
+
+        lock.lock();
+        done.wait(lock, [&] { return finished == wanted; });
+        current = nullptr;
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable wake, done;
+    std::vector<std::thread> workers;
+    const std::function<void(unsigned)>* current = nullptr;
+    unsigned wanted = 0, finished = 0, generation = 0;
+    bool stop = false;
+    static inline thread_local bool in_job = false; // set on the threads running a job of the pool
+
+    void worker_loop(const unsigned index, unsigned seen) {
+        in_job = true;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            wake.wait(lock, [&] { return stop || generation != seen; });
+            if (stop) return;
+            seen = generation;
+            if (index >= wanted) continue;
+
+            const std::function<void(unsigned)>* job = current;
+            lock.unlock();
+            (*job)(index + 1);
+            lock.lock();
+            if (++finished == wanted) done.notify_one();
+        }
+    }
+};
+
+// runs f(thread) on `threads` threads at once, from an openmp team when available
+template <typename F>
+void parallel_run(const unsigned threads, F&& f) {
+#ifdef _OPENMP
+    #pragma omp parallel num_threads(threads)
+    f(unsigned(omp_get_thread_num()));
+#else
+    ThreadPool::instance().run(threads, f);
+#endif
+}
+
+// calls f(i) for every i in [0, n) on thread_count threads with work stealing: every thread owns a deque
+// holding one contiguous block of indices, works through it from the front, and once it runs dry takes
+// single indices from the back of the other threads' deques. neighbouring indices thus mostly stay on
+// one thread while the load still evens out at the end
+template <typename F>
+void parallel_for(const size_t n, F&& f) {
+    struct alignas(64) Deque {
+        std::mutex mutex;
+        size_t front, back;
+    };
+
+    const unsigned threads = std::max(1u, std::min<unsigned>(thread_count, n));
+    std::vector<Deque> deques(threads);
+    for (unsigned t = 0; t < threads; ++t) {
+        deques[t].front = n * t / threads;
+        deques[t].back = n * (t + 1) / threads;
+    }
+
+    parallel_run(threads, [&](const unsigned self) {
+        while (true) {
+            size_t i = n;
+            {
+                Deque& own = deques[self];
+                std::lock_guard<std::mutex> lock(own.mutex);
+                if (own.front < own.back) i = own.front++;
+            }
+            for (unsigned k = 1; i == n && k < threads; ++k) {
+                Deque& victim = deques[(self + k) % threads];
+                std::lock_guard<std::mutex> lock(victim.mutex);
+                if (victim.front < victim.back) i = --victim.back;
+            }
+            if (i == n) return;
+            f(i);
+        }
+    });
+}
@@ -0,0 +1,229 @@
+#pragma once
+
+#include <bit>
+#include <cmath>
+#include <limits>
+#include <cstdint>
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
+
+#include "types.h"
+
+#if defined(__AVX512F__)
+constexpr int RAY_PACKET_SIZE = 16;
+#else
+constexpr int RAY_PACKET_SIZE = 8;
+#endif
+
+// coherent rays traced together through the bvhs, one lane per ray. every ray lies in the cone from apex spanned by
+// the lane's cone vector: for rays from a shared origin (primary rays) the apex is that origin and the cone vectors
+// their directions, for rays ending at a shared point (shadow rays to a point light) the apex is that point and the
+// cone vectors lead back to the origins. rays may stray from the cone by up to pad on every axis, as shadow rays
+// leaving from slightly off the surface do. lanes are selected by bitmasks of active rays, the others are ignored
+struct alignas(64) RayPacket {
+    static constexpr int N = RAY_PACKET_SIZE;
+
+    // origins, directions and their inverses as structure of arrays, so that a box is tested against every lane at once
+    alignas(64) float ox[N] = {}, oy[N] = {}, oz[N] = {};
+    alignas(64) float dx[N] = {}, dy[N] = {}, dz[N] = {};
+    alignas(64) float ix[N] = {}, iy[N] = {}, iz[N] = {};
+    vec3f apex;
+    vec3f cone[N];
+    float pad = 0;
+
+    inline vec3f origin(const int lane) const { return vec3f(ox[lane], oy[lane], oz[lane]); }
+    inline vec3f direction(const int lane) const { return vec3f(dx[lane], dy[lane], dz[lane]); }
+
+    void set(const int lane, const vec3f& o, const vec3f& d, const vec3f& c) {
+        ox[lane] = o.x; oy[lane] = o.y; oz[lane] = o.z;
+        dx[lane] = d.x; dy[lane] = d.y; dz[lane] = d.z;
+        ix[lane] = 1.f/d.x; iy[lane] = 1.f/d.y; iz[lane] = 1.f/d.z;
+        cone[lane] = c;
+    }
+
+    // the packet moved into the space of an instance, which leaves the distances along the rays as they were
+    RayPacket transformed(const mat3x4& m, const uint32_t active) const {
+        RayPacket p;
+        p.apex = m.transform_point(apex);
+        for (const vec4f& row : m.rows) p.pad = std::max(p.pad, pad * (std::abs(row.x) + std::abs(row.y) + std::abs(row.z)));
+        for (uint32_t mask = active; mask; mask &= mask - 1) {
+            const int lane = std::countr_zero(mask);
+            p.set(lane, m.transform_point(origin(lane)), m.transform_vector(direction(lane)), m.transform_vector(cone[lane]));
+        }
+        return p;
+    }
+
+    // the slab test of AABB::intersect on every lane at once, with the same arithmetic so that a lane visits the
+    // boxes its single ray would. returns the lanes that hit the box from min to max closer than their t_max, the
+    // inactive ones included, and the entry distances of the hit lanes in t_near
+    inline uint32_t intersect(const vec3f& min, const vec3f& max, const float* t_max, float* t_near) const {
+        // std::min(a, b) is b < a ? b : a, which is _mm_min_ps(b, a) even for nan, and the same goes for max
+#if defined(__AVX512F__)
+        if constexpr (N == 16) {
+            // gcc's _mm512_min_ps and _mm512_max_ps pass an uninitialised vector through an all ones mask, which
+            // -Wmaybe-uninitialized reports. the zero masking forms with every lane selected start from a zeroed one
+            auto vmin = [](const __m512 a, const __m512 b) { return _mm512_maskz_min_ps(0xffff, a, b); };
+            auto vmax = [](const __m512 a, const __m512 b) { return _mm512_maskz_max_ps(0xffff, a, b); };
+            const __m512 tx1 = _mm512_mul_ps(_mm512_sub_ps(_mm512_set1_ps(min.x), _mm512_load_ps(ox)), _mm512_load_ps(ix));
+            const __m512 tx2 = _mm512_mul_ps(_mm512_sub_ps(_mm512_set1_ps(max.x), _mm512_load_ps(ox)), _mm512_load_ps(ix));
+            __m512 tmin = vmin(tx2, tx1), tmax = vmax(tx2, tx1);
+            const __m512 ty1 = _mm512_mul_ps(_mm512_sub_ps(_mm512_set1_ps(min.y), _mm512_load_ps(oy)), _mm512_load_ps(iy));
+            const __m512 ty2 = _mm512_mul_ps(_mm512_sub_ps(_mm512_set1_ps(max.y), _mm512_load_ps(oy)), _mm512_load_ps(iy));
+            tmin = vmax(vmin(ty2, ty1), tmin); tmax = vmin(vmax(ty2, ty1), tmax);
+            const __m512 tz1 = _mm512_mul_ps(_mm512_sub_ps(_mm512_set1_ps(min.z), _mm512_load_ps(oz)), _mm512_load_ps(iz));
+            const __m512 tz2 = _mm512_mul_ps(_mm512_sub_ps(_mm512_set1_ps(max.z), _mm512_load_ps(oz)), _mm512_load_ps(iz));
+            tmin = vmax(vmin(tz2, tz1), tmin); tmax = vmin(vmax(tz2, tz1), tmax);
+            _mm512_storeu_ps(t_near, tmin);
+            return _mm512_cmp_ps_mask(tmax, tmin, _CMP_GE_OQ) & _mm512_cmp_ps_mask(tmax, _mm512_setzero_ps(), _CMP_GT_OQ)
+                & _mm512_cmp_ps_mask(tmin, _mm512_loadu_ps(t_max), _CMP_LT_OQ);
+        }
+#endif
+#if defined(__AVX__)
+        if constexpr (N % 8 == 0) {
+            uint32_t hit = 0;
+            for (int c = 0; c < N; c += 8) {
+                const __m256 tx1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(min.x), _mm256_load_ps(ox + c)), _mm256_load_ps(ix + c));
+                const __m256 tx2 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(max.x), _mm256_load_ps(ox + c)), _mm256_load_ps(ix + c));
+                __m256 tmin = _mm256_min_ps(tx2, tx1), tmax = _mm256_max_ps(tx2, tx1);
+                const __m256 ty1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(min.y), _mm256_load_ps(oy + c)), _mm256_load_ps(iy + c));
+                const __m256 ty2 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(max.y), _mm256_load_ps(oy + c)), _mm256_load_ps(iy + c));
+                tmin = _mm256_max_ps(_mm256_min_ps(ty2, ty1), tmin); tmax = _mm256_min_ps(_mm256_max_ps(ty2, ty1), tmax);
+                const __m256 tz1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(min.z), _mm256_load_ps(oz + c)), _mm256_load_ps(iz + c));
+                const __m256 tz2 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(max.z), _mm256_load_ps(oz + c)), _mm256_load_ps(iz + c));
+                tmin = _mm256_max_ps(_mm256_min_ps(tz2, tz1), tmin); tmax = _mm256_min_ps(_mm256_max_ps(tz2, tz1), tmax);
+                _mm256_storeu_ps(t_near + c, tmin);
+                const __m256 h = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(tmax, tmin, _CMP_GE_OQ), _mm256_cmp_ps(tmax, _mm256_setzero_ps(), _CMP_GT_OQ)),
+                    _mm256_cmp_ps(tmin, _mm256_loadu_ps(t_max + c), _CMP_LT_OQ));
+                hit |= uint32_t(_mm256_movemask_ps(h)) << c;
+            }
+            return hit;
+        }
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+        if constexpr (N % 4 == 0) {
+            uint32_t hit = 0;
+            for (int c = 0; c < N; c += 4) {
+                const __m128 tx1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(min.x), _mm_load_ps(ox + c)), _mm_load_ps(ix + c));
+                const __m128 tx2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(max.x), _mm_load_ps(ox + c)), _mm_load_ps(ix + c));
+                __m128 tmin = _mm_min_ps(tx2, tx1), tmax = _mm_max_ps(tx2, tx1);
+                const __m128 ty1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(min.y), _mm_load_ps(oy + c)), _mm_load_ps(iy + c));
+                const __m128 ty2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(max.y), _mm_load_ps(oy + c)), _mm_load_ps(iy + c));
+                tmin = _mm_max_ps(_mm_min_ps(ty2, ty1), tmin); tmax = _mm_min_ps(_mm_max_ps(ty2, ty1), tmax);
+                const __m128 tz1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(min.z), _mm_load_ps(oz + c)), _mm_load_ps(iz + c));
+                const __m128 tz2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(max.z), _mm_load_ps(oz + c)), _mm_load_ps(iz + c));
+                tmin = _mm_max_ps(_mm_min_ps(tz2, tz1), tmin); tmax = _mm_min_ps(_mm_max_ps(tz2, tz1), tmax);
+                _mm_storeu_ps(t_near + c, tmin);
+                const __m128 h = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(tmax, tmin), _mm_cmpgt_ps(tmax, _mm_setzero_ps())),
+                    _mm_cmplt_ps(tmin, _mm_loadu_ps(t_max + c)));
+                hit |= uint32_t(_mm_movemask_ps(h)) << c;
+            }
+            return hit;
+        }
+#endif
+        uint32_t hit = 0;
+        for (int lane = 0; lane < N; ++lane) {
+            float tx1 = (min.x - ox[lane]) * ix[lane], tx2 = (max.x - ox[lane]) * ix[lane];
+            float tmin = std::min(tx1, tx2), tmax = std::max(tx1, tx2);
+            float ty1 = (min.y - oy[lane]) * iy[lane], ty2 = (max.y - oy[lane]) * iy[lane];
+            tmin = std::max(tmin, std::min(ty1, ty2)); tmax = std::min(tmax, std::max(ty1, ty2));
+            float tz1 = (min.z - oz[lane]) * iz[lane], tz2 = (max.z - oz[lane]) * iz[lane];
+            tmin = std::max(tmin, std::min(tz1, tz2)); tmax = std::min(tmax, std::max(tz1, tz2));
+            t_near[lane] = tmin;
+            hit |= uint32_t(tmax >= tmin && tmax > 0 && tmin < t_max[lane]) << lane;
+        }
+        return hit;
+    }
+};
+
+// planes bounding the cone of the active rays of a packet, nodes entirely outside of them are skipped without
+// testing any ray. built around the axis the cone vectors all point along the most, a packet whose vectors don't
+// share the sign on any axis gets no planes and culls nothing
+struct Frustum {
+    bool enabled = false;
+    vec3f apex;
+    float pad;
+    // a point p is outside when n * (p - apex) < 0 for any of the 5 plane normals n, stored per axis and
+    // padded with zero normals so that all planes are tested in one register
+    alignas(32) float nx[8] = {}, ny[8] = {}, nz[8] = {};
+
+    Frustum(const RayPacket& packet, const uint32_t active) : apex(packet.apex), pad(packet.pad) {
+        if (!active) return;
+        vec3f sum(0, 0, 0);
+        for (uint32_t mask = active; mask; mask &= mask - 1) sum = sum + packet.cone[std::countr_zero(mask)];
+        const vec3f a(std::abs(sum.x), std::abs(sum.y), std::abs(sum.z));
+        const int k = a.x > a.y ? (a.x > a.z ? 0 : 2) : (a.y > a.z ? 1 : 2);
+        const float s = sum[k] < 0 ? -1.f : 1.f;
+
+        // range of the slopes of the cone vectors against k, per other axis
+        const int u = k == 2 ? 0 : k + 1, v = u == 2 ? 0 : u + 1;
+        float lo[2] = {std::numeric_limits<float>::max(), std::numeric_limits<float>::max()};
+        float hi[2] = {-std::numeric_limits<float>::max(), -std::numeric_limits<float>::max()};
+        for (uint32_t mask = active; mask; mask &= mask - 1) {
+            const vec3f& c = packet.cone[std::countr_zero(mask)];
+            if (!(c[k] * s > 0)) return;
+            for (int i = 0; i < 2; ++i) {
+                const float slope = c[i ? v : u] / c[k];
+                lo[i] = std::min(lo[i], slope);
+                hi[i] = std::max(hi[i], slope);
+            }
+        }
+
+        // widened a little, so that rounding can't make a plane cut off a box that a slab test finds hit
+        for (int i = 0; i < 2; ++i) {
+            const int axis = i ? v : u;
+            const float margin = 1e-4f * (1 + std::max(std::abs(lo[i]), std::abs(hi[i])));
+            vec3f n_lo(0, 0, 0), n_hi(0, 0, 0);
+            n_lo[axis] = s;
+            n_lo[k] = -s * (lo[i] - margin);
+            n_hi[axis] = -s;
+            n_hi[k] = s * (hi[i] + margin);
+            set(2*i, n_lo);
+            set(2*i + 1, n_hi);
+        }
+        vec3f n_k(0, 0, 0);
+        n_k[k] = s;
+        set(4, n_k);
+        enabled = true;
+    }
+
+    // of the box from min to max; the corner furthest along a normal gives the largest product per axis
+    inline bool outside(const vec3f& min, const vec3f& max) const {
+        if (!enabled) return false;
+        const vec3f lo = min - vec3f(pad, pad, pad) - apex, hi = max + vec3f(pad, pad, pad) - apex;
+#if defined(__AVX__)
+        const __m256 x = _mm256_load_ps(nx), y = _mm256_load_ps(ny), z = _mm256_load_ps(nz);
+        const __m256 d = _mm256_add_ps(_mm256_add_ps(
+            _mm256_max_ps(_mm256_mul_ps(x, _mm256_set1_ps(lo.x)), _mm256_mul_ps(x, _mm256_set1_ps(hi.x))),
+            _mm256_max_ps(_mm256_mul_ps(y, _mm256_set1_ps(lo.y)), _mm256_mul_ps(y, _mm256_set1_ps(hi.y)))),
+            _mm256_max_ps(_mm256_mul_ps(z, _mm256_set1_ps(lo.z)), _mm256_mul_ps(z, _mm256_set1_ps(hi.z))));
+        return _mm256_movemask_ps(_mm256_cmp_ps(d, _mm256_setzero_ps(), _CMP_LT_OQ)) != 0;
+#elif defined(__SSE2__) || defined(_M_X64)
+        for (int i = 0; i < 8; i += 4) {
+            const __m128 x = _mm_load_ps(nx + i), y = _mm_load_ps(ny + i), z = _mm_load_ps(nz + i);
+            const __m128 d = _mm_add_ps(_mm_add_ps(
+                _mm_max_ps(_mm_mul_ps(x, _mm_set1_ps(lo.x)), _mm_mul_ps(x, _mm_set1_ps(hi.x))),
+                _mm_max_ps(_mm_mul_ps(y, _mm_set1_ps(lo.y)), _mm_mul_ps(y, _mm_set1_ps(hi.y)))),
+                _mm_max_ps(_mm_mul_ps(z, _mm_set1_ps(lo.z)), _mm_mul_ps(z, _mm_set1_ps(hi.z))));
+            if (_mm_movemask_ps(_mm_cmplt_ps(d, _mm_setzero_ps()))) return true;
+        }
+        return false;
+#else
+        for (int i = 0; i < 5; ++i) {
+            const float d = std::max(nx[i] * lo.x, nx[i] * hi.x) + std::max(ny[i] * lo.y, ny[i] * hi.y)
+                            + std::max(nz[i] * lo.z, nz[i] * hi.z);
+            if (d < 0) return true;
+        }
+        return false;
+#endif
+    }
+
+private:
+    void set(const int i, const vec3f& n) {
+        nx[i] = n.x;
+        ny[i] = n.y;
+        nz[i] = n.z;
+    }
+};
@@ -0,0 +1,259 @@
+#pragma once
+
+#include <bit>
+#include <memory>
+#include <vector>
+#include <cstdint>
+
+#include "types.h"
+#include "shapes.h"
+#include "model.h"
+#include "bvh.h"
+#include "sphere_pack.h"
+
+// a placement of a shared mesh, rays are moved into the mesh's object space rather than the mesh into the world
+struct Instance {
+    std::shared_ptr<const Model> mesh;
+    mat3x4 transform;
+    mat3x4 inverse;
+    Material material;
+    AABB bounds; // world space
+
+    Instance(std::shared_ptr<const Model> m, const mat3x4& t, const Material& mat)
+        : mesh{std::move(m)}, transform{t}, inverse{t.inverse()}, material{mat} {
+        if (mesh->bounds.empty()) return;
+        for (int corner = 0; corner < 8; ++corner) {
+            const vec3f p(corner & 1 ? mesh->bounds.max.x : mesh->bounds.min.x,
+                          corner & 2 ? mesh->bounds.max.y : mesh->bounds.min.y,
+                          corner & 4 ? mesh->bounds.max.z : mesh->bounds.min.z);
+            bounds.grow(transform.transform_point(p));
+        }
+    }
+
+    // the direction is left unnormalized so that distances along the ray match the world ones
+    bool intersect(const vec3f& origin, const vec3f& direction, float& t_dist, int& prim) const {
+        return mesh->intersect(inverse.transform_point(origin), inverse.transform_vector(direction), t_dist, prim);
+    }
+
+    bool occluded(const vec3f& origin, const vec3f& direction, const float t_max) const {
+        return mesh->occluded(inverse.transform_point(origin), inverse.transform_vector(direction), t_max);
+    }
+
+    uint32_t intersect(const RayPacket& packet, const uint32_t active, float* t_dist, int* prim) const {
+        return mesh->intersect(packet.transformed(inverse, active), active, t_dist, prim);
+    }
+
+    uint32_t occluded(const RayPacket& packet, const uint32_t active, const float* t_max) const {
+        return mesh->occluded(packet.transformed(inverse, active), active, t_max);
+    }
+
+    // world space normal of a primitive hit by intersect
+    vec3f normal(const int prim) const {
+        return inverse.transpose_transform_vector(mesh->normal(prim)).normalize();
+    }
+};
+
+// two level scene: a top level bvh over the bounds of every object, each of which is intersected
+// on its own (mesh instances through their shared mesh bvh)
+struct Scene {
+    enum class ObjectKind : uint32_t { SPHERE, INSTANCE, CHECKERBOARD };
+
+    struct Object {
+        ObjectKind kind;
+        uint32_t index; // into the vector of its kind, spheres are intersected by the pack
+    };
+
+    // the nearest object along a ray, face is the sphere or the mesh primitive hit
+    struct Hit {
+        float t;
+        Object object;
+        int face;
+    };
+
+    std::vector<Sphere> spheres = {};
+    std::vector<SpherePack<SPHERE_PACK_WIDTH>> sphere_packs = {}; // built from spheres
+    std::vector<Instance> instances = {};
+    std::vector<Checkerboard> checkerboards = {};
+
+    std::vector<Object> objects = {};
+    BVH top;
+
+    // call after adding or moving objects
+    void build() {
+        objects.clear();
+        std::vector<AABB> object_bounds;
+        sphere_packs = pack_spheres(spheres);
+        for (uint32_t i = 0; i < sphere_packs.size(); ++i) {
+            AABB bounds;
+            for (int lane = 0; lane < SPHERE_PACK_WIDTH && i * SPHERE_PACK_WIDTH + lane < spheres.size(); ++lane) {
+                const Sphere& sphere = spheres[sphere_packs[i].id[lane]];
+                const vec3f r(sphere.radius, sphere.radius, sphere.radius);
+                bounds.grow(AABB{sphere.center - r, sphere.center + r});
+            }
+            objects.push_back({ObjectKind::SPHERE, i});
+            object_bounds.push_back(bounds);
+        }
+        for (uint32_t i = 0; i < instances.size(); ++i) {
+            if (instances[i].bounds.empty()) continue;
+            objects.push_back({ObjectKind::INSTANCE, i});
+            object_bounds.push_back(instances[i].bounds);
+        }
+        for (uint32_t i = 0; i < checkerboards.size(); ++i) {
+            objects.push_back({ObjectKind::CHECKERBOARD, i});
+            object_bounds.push_back({checkerboards[i].min, checkerboards[i].max});
+        }
+        top.build(object_bounds);
+    }
+
+    // closest hit closer than 1000 units, fills in the hit point, the normal facing the ray, the material and the
+    // surface curvature (1/radius for spheres, 0 for the flat faces of meshes and planes)
+    bool intersect(const vec3f& origin, const vec3f& direction, vec3f& hit, vec3f& N, Material& material, float& curvature) const {
+        Hit nearest;
+        if (!trace(origin, direction, nearest)) return false;
+        surface(origin, direction, nearest, hit, N, material, curvature);
+        return true;
+    }
+
+    // the closest hit alone, closer than 1000 units
+    bool trace(const vec3f& origin, const vec3f& direction, Hit& nearest) const {
+        nearest = {1000, {}, -1};
+        return top.intersect(origin, direction, nearest.t, [&](const uint32_t o, float& t_max) {
+            const Object& object = objects[o];
+            float dist = t_max;
+            int face = -1;
+            bool hit = false;
+            switch (object.kind) {
+                case ObjectKind::SPHERE: {
+                    const int lane = sphere_packs[object.index].intersect(origin, direction, t_max, dist);
+                    hit = lane >= 0;
+                    if (hit) face = int(sphere_packs[object.index].id[lane]);
+                    break;
+                }
+                case ObjectKind::INSTANCE:     hit = instances[object.index].intersect(origin, direction, dist, face); break;
+                case ObjectKind::CHECKERBOARD: hit = checkerboards[object.index].ray_intersect(origin, direction, dist); break;
+            }
+            if (!hit || dist >= t_max) return false;
+
+            t_max = dist;
+            nearest.object = object;
+            nearest.face = face;
+            return true;
+        });
+    }
+
+    // the lanes of the packet that hit anything closer than 1000 units, and their hits. one pass down the top
+    // bvh for the whole packet, then one down each mesh bvh the packet's rays reach
+    uint32_t trace(const RayPacket& packet, const uint32_t active, Hit* nearest) const {
+        float t[RayPacket::N] = {};
+        for (uint32_t mask = active; mask; mask &= mask - 1) {
+            const int lane = std::countr_zero(mask);
+            nearest[lane] = {1000, {}, -1};
+            t[lane] = 1000;
+        }
+        return top.intersect_packet(packet, active, t, [&](const uint32_t first, const uint32_t count, const uint32_t lanes) {
+            uint32_t hit = 0;
+            for (uint32_t i = first; i < first + count; ++i) {
+                const Object& object = objects[top.prim_indices[i]];
+                float dist[RayPacket::N] = {};
+                int face[RayPacket::N];
+                uint32_t object_hit = 0;
+                for (uint32_t mask = lanes; mask; mask &= mask - 1) dist[std::countr_zero(mask)] = t[std::countr_zero(mask)];
+                if (object.kind == ObjectKind::INSTANCE) {
+                    object_hit = instances[object.index].intersect(packet, lanes, dist, face);
+                } else {
+                    for (uint32_t mask = lanes; mask; mask &= mask - 1) {
+                        const int lane = std::countr_zero(mask);
+                        const vec3f origin = packet.origin(lane);
+                        const vec3f direction = packet.direction(lane);
+                        if (object.kind == ObjectKind::SPHERE) {
+                            const int slot = sphere_packs[object.index].intersect(origin, direction, t[lane], dist[lane]);
+                            if (slot < 0) continue;
+                            face[lane] = int(sphere_packs[object.index].id[slot]);
+                        } else if (!checkerboards[object.index].ray_intersect(origin, direction, dist[lane])) {
+                            continue;
+                        }
+                        object_hit |= 1u << lane;
+                    }
+                }
+                for (uint32_t mask = object_hit; mask; mask &= mask - 1) {
+                    const int lane = std::countr_zero(mask);
+                    if (dist[lane] >= t[lane]) continue;
+                    t[lane] = dist[lane];
+                    nearest[lane] = {dist[lane], object, object.kind == ObjectKind::CHECKERBOARD ? -1 : face[lane]};
+                    hit |= 1u << lane;
+                }
+            }
+            return hit;
+        });
+    }
+
+    // the shading inputs at a hit found by trace
+    void surface(const vec3f& origin, const vec3f& direction, const Hit& nearest, vec3f& hit, vec3f& N,
+                 Material& material, float& curvature) const {
+        hit = origin + direction * nearest.t;
+        curvature = 0;
+        switch (nearest.object.kind) {
+            case ObjectKind::SPHERE: {
+                const Sphere& sphere = spheres[nearest.face];
+                N = (hit - sphere.center).normalize();
+                material = sphere.material;
+                curvature = 1 / sphere.radius;
+                break;
+            }
+            case ObjectKind::INSTANCE: {
+                const Instance& instance = instances[nearest.object.index];
+                N = instance.normal(nearest.face);
+                if (N * direction > 0) N = -N;
+                material = instance.material;
+                break;
+            }
+            case ObjectKind::CHECKERBOARD: {
+                const Checkerboard& board = checkerboards[nearest.object.index];
+                N = vec3f(0,1,0);
+                material = board.material;
+                material.diffuse_color = board.color(hit);
+                break;
+            }
+        }
+    }
+
+    // whether anything lies along the ray closer than t_max, without finding the nearest hit or shading it
+    bool occluded(const vec3f& origin, const vec3f& direction, const float t_max) const {
+        return top.occluded(origin, direction, t_max, [&](const uint32_t o, float) {
+            const Object& object = objects[o];
+            float dist;
+            switch (object.kind) {
+                case ObjectKind::SPHERE:       return sphere_packs[object.index].intersect(origin, direction, t_max, dist) >= 0;
+                case ObjectKind::INSTANCE:     return instances[object.index].occluded(origin, direction, t_max);
+                case ObjectKind::CHECKERBOARD: return checkerboards[object.index].ray_intersect(origin, direction, dist) && dist < t_max;
+            }
+            return false;
+        });
+    }
+
+    // the lanes of the packet with anything closer than their t_max
+    uint32_t occluded(const RayPacket& packet, const uint32_t active, const float* t_max) const {
+        return top.occluded_packet(packet, active, t_max, [&](const uint32_t first, const uint32_t count, const uint32_t lanes) {
+            uint32_t blocked = 0;
+            for (uint32_t i = first; i < first + count && blocked != lanes; ++i) {
+                const Object& object = objects[top.prim_indices[i]];
+                const uint32_t open = lanes & ~blocked;
+                if (object.kind == ObjectKind::INSTANCE) {
+                    blocked |= instances[object.index].occluded(packet, open, t_max);
+                    continue;
+                }
+                for (uint32_t mask = open; mask; mask &= mask - 1) {
+                    const int lane = std::countr_zero(mask);
+                    const vec3f origin = packet.origin(lane);
+                    const vec3f direction = packet.direction(lane);
+                    float dist;
+                    const bool hit = object.kind == ObjectKind::SPHERE
+                        ? sphere_packs[object.index].intersect(origin, direction, t_max[lane], dist) >= 0
+                        : checkerboards[object.index].ray_intersect(origin, direction, dist) && dist < t_max[lane];
+                    if (hit) blocked |= 1u << lane;
+                }
+            }
+            return blocked;
+        });
+    }
+};
@@ -46,4 +46,25 @@ struct Sphere {
 
 		return true;
 	}
-};
\ No newline at end of file
+};
+
+// finite horizontal checkerboard rectangle at height y spanning [min.x, max.x] x [min.z, max.z]
+struct Checkerboard {
+	float y;
+	vec3f min, max;
+	Material material;
+
+	Checkerboard(const float h, const vec3f& lo, const vec3f& hi) : y{h}, min{lo.x, h, lo.z}, max{hi.x, h, hi.z}, material{} {}
+
+	bool ray_intersect(const vec3f& origin, const vec3f& direction, float& plane_dist) const {
+		if (fabs(direction.y) <= 1e-3) return false;
+
+		plane_dist = (y - origin.y) / direction.y;
+		vec3f pt = origin + direction * plane_dist;
+		return plane_dist > 0 && pt.x > min.x && pt.x < max.x && pt.z > min.z && pt.z < max.z;
+	}
+
+	vec3f color(const vec3f& hit) const {
+		return ((int(.5*hit.x+1000) + int(.5*hit.z)) & 1 ? vec3f(1,1,1) : vec3f(1, .7, .3)) * .3;
+	}
+};
@@ -0,0 +1,181 @@
+#pragma once
+
+#include <bit>
+#include <cmath>
+#include <vector>
+#include <limits>
+#include <cstdint>
+#include <numeric>
+#include <algorithm>
+
+#if defined(__SSE4_1__)
+#include <immintrin.h>
+#endif
+
+#include "types.h"
+#include "shapes.h"
+#include "bvh.h"
+
+#if defined(__AVX512F__)
+constexpr int SPHERE_PACK_WIDTH = 16;
+#elif defined(__AVX__)
+constexpr int SPHERE_PACK_WIDTH = 8;
+#else
+constexpr int SPHERE_PACK_WIDTH = 4;
+#endif
+
+// N spheres stored as structure of arrays and intersected all at once, the materials stay with the Sphere
+// objects that id points to. unused slots have a squared radius of -inf, which no ray hits
+template <int N>
+struct alignas(64) SpherePack {
+    static constexpr int WIDTH = N;
+
+    float cx[N], cy[N], cz[N];
+    float r2[N];
+    uint32_t id[N];
+
+    // same arithmetic as Sphere::ray_intersect per lane, returns the slot of the nearest sphere hit closer than
+    // t_max and its distance in t, or -1
+    inline int intersect(const vec3f& origin, const vec3f& direction, const float t_max, float& t) const {
+#if defined(__AVX512F__)
+        if constexpr (N == 16) {
+            const __m512 dx = _mm512_set1_ps(direction.x), dy = _mm512_set1_ps(direction.y), dz = _mm512_set1_ps(direction.z);
+            const __m512 lx = _mm512_sub_ps(_mm512_load_ps(cx), _mm512_set1_ps(origin.x));
+            const __m512 ly = _mm512_sub_ps(_mm512_load_ps(cy), _mm512_set1_ps(origin.y));
+            const __m512 lz = _mm512_sub_ps(_mm512_load_ps(cz), _mm512_set1_ps(origin.z));
+            const __m512 tca = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(lz, dz), _mm512_mul_ps(ly, dy)), _mm512_mul_ps(lx, dx));
+            const __m512 ll = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(lz, lz), _mm512_mul_ps(ly, ly)), _mm512_mul_ps(lx, lx));
+            const __m512 d2 = _mm512_sub_ps(ll, _mm512_mul_ps(tca, tca));
+            const __m512 radius2 = _mm512_load_ps(r2);
+            // gcc's unmasked avx-512 sqrt, min and extract pass an uninitialised vector through an all ones mask,
+            // which -Wmaybe-uninitialized reports. the zero masking forms below start from a zeroed one instead
+            const __mmask16 inside = _mm512_cmp_ps_mask(d2, radius2, _CMP_LE_OQ);
+            const __m512 thc = _mm512_maskz_sqrt_ps(inside, _mm512_sub_ps(radius2, d2));
+            const __m512 t0 = _mm512_sub_ps(tca, thc), t1 = _mm512_add_ps(tca, thc);
+            const __m512 zero = _mm512_setzero_ps();
+            const __m512 dist = _mm512_mask_blend_ps(_mm512_cmp_ps_mask(t0, zero, _CMP_LT_OQ), t0, t1);
+            const __mmask16 hit = inside & _mm512_cmp_ps_mask(dist, zero, _CMP_GE_OQ)
+                & _mm512_cmp_ps_mask(dist, _mm512_set1_ps(t_max), _CMP_LT_OQ);
+            if (!hit) return -1;
+            // horizontal min over the hit lanes, the others hold +inf: the halves are folded together and then
+            // reduced as on the 8 wide path
+            const __m512 inf = _mm512_set1_ps(std::numeric_limits<float>::infinity());
+            const __m512d masked = _mm512_castps_pd(_mm512_mask_blend_ps(hit, inf, dist));
+            __m256 m = _mm256_min_ps(_mm256_castpd_ps(_mm512_maskz_extractf64x4_pd(0xf, masked, 0)),
+                _mm256_castpd_ps(_mm512_maskz_extractf64x4_pd(0xf, masked, 1)));
+            m = _mm256_min_ps(m, _mm256_permute2f128_ps(m, m, 1));
+            m = _mm256_min_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+            m = _mm256_min_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+            t = _mm256_cvtss_f32(m);
+            return std::countr_zero(unsigned(_mm512_mask_cmp_ps_mask(hit, dist, _mm512_set1_ps(t), _CMP_EQ_OQ)));
+        }
+#endif
+#if defined(__AVX__)
+        if constexpr (N == 8) {
+            const __m256 dx = _mm256_set1_ps(direction.x), dy = _mm256_set1_ps(direction.y), dz = _mm256_set1_ps(direction.z);
+            const __m256 lx = _mm256_sub_ps(_mm256_load_ps(cx), _mm256_set1_ps(origin.x));
+            const __m256 ly = _mm256_sub_ps(_mm256_load_ps(cy), _mm256_set1_ps(origin.y));
+            const __m256 lz = _mm256_sub_ps(_mm256_load_ps(cz), _mm256_set1_ps(origin.z));
+            const __m256 tca = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(lz, dz), _mm256_mul_ps(ly, dy)), _mm256_mul_ps(lx, dx));
+            const __m256 ll = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(lz, lz), _mm256_mul_ps(ly, ly)), _mm256_mul_ps(lx, lx));
+            const __m256 d2 = _mm256_sub_ps(ll, _mm256_mul_ps(tca, tca));
+            const __m256 radius2 = _mm256_load_ps(r2);
+            const __m256 thc = _mm256_sqrt_ps(_mm256_sub_ps(radius2, d2));
+            const __m256 t0 = _mm256_sub_ps(tca, thc), t1 = _mm256_add_ps(tca, thc);
+            const __m256 zero = _mm256_setzero_ps();
+            const __m256 dist = _mm256_blendv_ps(t0, t1, _mm256_cmp_ps(t0, zero, _CMP_LT_OQ));
+            const __m256 hit = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(d2, radius2, _CMP_LE_OQ), _mm256_cmp_ps(dist, zero, _CMP_GE_OQ)),
+                _mm256_cmp_ps(dist, _mm256_set1_ps(t_max), _CMP_LT_OQ));
+            if (_mm256_testz_ps(hit, hit)) return -1;
+            // horizontal min over the hit lanes, the others hold +inf
+            const __m256 masked = _mm256_blendv_ps(_mm256_set1_ps(std::numeric_limits<float>::infinity()), dist, hit);
+            __m256 m = _mm256_min_ps(masked, _mm256_permute2f128_ps(masked, masked, 1));
+            m = _mm256_min_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+            m = _mm256_min_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+            t = _mm256_cvtss_f32(m);
+            return std::countr_zero(unsigned(_mm256_movemask_ps(_mm256_and_ps(hit, _mm256_cmp_ps(dist, m, _CMP_EQ_OQ)))));
+        }
+#endif
+#if defined(__SSE4_1__)
+        if constexpr (N == 4) {
+            const __m128 dx = _mm_set1_ps(direction.x), dy = _mm_set1_ps(direction.y), dz = _mm_set1_ps(direction.z);
+            const __m128 lx = _mm_sub_ps(_mm_load_ps(cx), _mm_set1_ps(origin.x));
+            const __m128 ly = _mm_sub_ps(_mm_load_ps(cy), _mm_set1_ps(origin.y));
+            const __m128 lz = _mm_sub_ps(_mm_load_ps(cz), _mm_set1_ps(origin.z));
+            const __m128 tca = _mm_add_ps(_mm_add_ps(_mm_mul_ps(lz, dz), _mm_mul_ps(ly, dy)), _mm_mul_ps(lx, dx));
+            const __m128 ll = _mm_add_ps(_mm_add_ps(_mm_mul_ps(lz, lz), _mm_mul_ps(ly, ly)), _mm_mul_ps(lx, lx));
+            const __m128 d2 = _mm_sub_ps(ll, _mm_mul_ps(tca, tca));
+            const __m128 radius2 = _mm_load_ps(r2);
+            const __m128 thc = _mm_sqrt_ps(_mm_sub_ps(radius2, d2));
+            const __m128 t0 = _mm_sub_ps(tca, thc), t1 = _mm_add_ps(tca, thc);
+            const __m128 zero = _mm_setzero_ps();
+            const __m128 dist = _mm_blendv_ps(t0, t1, _mm_cmplt_ps(t0, zero));
+            const __m128 hit = _mm_and_ps(_mm_and_ps(_mm_cmple_ps(d2, radius2), _mm_cmpge_ps(dist, zero)),
+                _mm_cmplt_ps(dist, _mm_set1_ps(t_max)));
+            if (!_mm_movemask_ps(hit)) return -1;
+            const __m128 masked = _mm_blendv_ps(_mm_set1_ps(std::numeric_limits<float>::infinity()), dist, hit);
+            __m128 m = _mm_min_ps(masked, _mm_shuffle_ps(masked, masked, _MM_SHUFFLE(1, 0, 3, 2)));
+            m = _mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+            t = _mm_cvtss_f32(m);
+            return std::countr_zero(unsigned(_mm_movemask_ps(_mm_and_ps(hit, _mm_cmpeq_ps(dist, m)))));
+        }
+#endif
+        int nearest = -1;
+        for (int i = 0; i < N; ++i) {
+            const float lx = cx[i] - origin.x, ly = cy[i] - origin.y, lz = cz[i] - origin.z;
+            const float tca = lz*direction.z + ly*direction.y + lx*direction.x;
+            const float d2 = lz*lz + ly*ly + lx*lx - tca*tca;
+            if (!(d2 <= r2[i])) continue;
+            const float thc = sqrtf(r2[i] - d2);
+            const float dist = tca - thc < 0 ? tca + thc : tca - thc;
+            if (dist >= 0 && dist < (nearest < 0 ? t_max : t)) {
+                t = dist;
+                nearest = i;
+            }
+        }
+        return nearest;
+    }
+};
+
+// spreads the low 10 bits of v out to every third bit
+inline uint32_t expand_bits3(uint32_t v) {
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v <<  8)) & 0x0300f00f;
+    v = (v | (v <<  4)) & 0x030c30c3;
+    v = (v | (v <<  2)) & 0x09249249;
+    return v;
+}
+
+// groups the spheres into packs of spatial neighbours, in morton order of their centers, so that the packs'
+// bounds stay tight for the bvh above them
+inline std::vector<SpherePack<SPHERE_PACK_WIDTH>> pack_spheres(const std::vector<Sphere>& spheres) {
+    constexpr int N = SPHERE_PACK_WIDTH;
+    AABB centers;
+    for (const Sphere& s : spheres) centers.grow(s.center);
+    const vec3f extent = centers.max - centers.min;
+    std::vector<uint32_t> codes(spheres.size()), order(spheres.size());
+    for (size_t i = 0; i < spheres.size(); ++i) {
+        const vec3f& c = spheres[i].center;
+        uint32_t q[3];
+        for (int a = 0; a < 3; ++a) q[a] = extent[a] > 0 ? uint32_t((c[a] - centers.min[a]) / extent[a] * 1023) : 0;
+        codes[i] = (expand_bits3(q[0]) << 2) | (expand_bits3(q[1]) << 1) | expand_bits3(q[2]);
+    }
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](const uint32_t a, const uint32_t b) { return codes[a] < codes[b]; });
+
+    std::vector<SpherePack<N>> packs((spheres.size() + N - 1) / N);
+    for (size_t p = 0; p < packs.size(); ++p) {
+        for (int i = 0; i < N; ++i) {
+            const size_t s = p * N + i;
+            const bool used = s < spheres.size();
+            const Sphere* sphere = used ? &spheres[order[s]] : nullptr;
+            packs[p].cx[i] = used ? sphere->center.x : 0;
+            packs[p].cy[i] = used ? sphere->center.y : 0;
+            packs[p].cz[i] = used ? sphere->center.z : 0;
+            packs[p].r2[i] = used ? sphere->radius * sphere->radius : -std::numeric_limits<float>::infinity();
+            packs[p].id[i] = used ? order[s] : 0;
+        }
+    }
+    return packs;
+}
@@ -0,0 +1,318 @@
+#pragma once
+
+#include <bit>
+#include <cmath>
+#include <limits>
+#include <cstdint>
+#include <utility>
+
+#if defined(__SSE4_1__)
+#include <immintrin.h>
+#endif
+
+#include "types.h"
+
+#if defined(__AVX__)
+constexpr int TRIANGLE_PACK_WIDTH = 8;
+#else
+constexpr int TRIANGLE_PACK_WIDTH = 4;
+#endif
+
+// whether the pack tests are vectorised in this build, the scalar loops test a leaf no faster than one face at
+// a time and only make the leaves larger
+#if defined(__SSE4_1__)
+constexpr bool TRIANGLE_PACK_SIMD = true;
+#else
+constexpr bool TRIANGLE_PACK_SIMD = false;
+#endif
+
+constexpr float TRIANGLE_EPSILON = 1e-5f; // smallest determinant and distance of a hit
+
+// keep the compiler from fusing the products of a function into fmas, for the watertight tests: a product fused
+// into a sum is rounded differently on the two faces of a shared edge, which lets rays slip through. gcc takes it
+// as an attribute of the function, NO_FP_CONTRACT, clang as a pragma at the start of its body, NO_FP_CONTRACT_BODY.
+// msvc doesn't contract without /fp:contract
+#if defined(__clang__)
+#define NO_FP_CONTRACT
+#define NO_FP_CONTRACT_BODY _Pragma("clang fp contract(off)")
+#elif defined(__GNUC__)
+#define NO_FP_CONTRACT __attribute__((optimize("fp-contract=off")))
+#define NO_FP_CONTRACT_BODY
+#else
+#define NO_FP_CONTRACT
+#define NO_FP_CONTRACT_BODY
+#endif
+
+// a ray prepared for the watertight test (woop, benthin & wald 2013): the axes permuted so that z is the
+// dominant direction, and the shear that turns the ray into the +z axis through the origin. the vertices are
+// only moved into that space, every edge function then uses the same rounded values on both sides of a shared
+// edge, and rays can't slip between triangles. that holds only as long as the compiler doesn't fuse the edge
+// functions' products into fmas, see NO_FP_CONTRACT
+struct WatertightRay {
+    vec3f origin;
+    int kx, ky, kz;
+    float sx, sy, sz;
+
+    WatertightRay() = default;
+    WatertightRay(const vec3f& o, const vec3f& direction) : origin(o) {
+        const vec3f a(std::abs(direction.x), std::abs(direction.y), std::abs(direction.z));
+        kz = a.x > a.y ? (a.x > a.z ? 0 : 2) : (a.y > a.z ? 1 : 2);
+        kx = kz == 2 ? 0 : kz + 1;
+        ky = kx == 2 ? 0 : kx + 1;
+        if (direction[kz] < 0) std::swap(kx, ky); // keeps the winding
+        sx = direction[kx] / direction[kz];
+        sy = direction[ky] / direction[kz];
+        sz = 1.f / direction[kz];
+    }
+};
+
+// hit distance along the ray that WatertightRay was made from, both faces count
+NO_FP_CONTRACT inline bool ray_intersect_watertight(const WatertightRay& ray, const vec3f& v0, const vec3f& v1, const vec3f& v2,
+float& t_dist) {
+    NO_FP_CONTRACT_BODY
+    const vec3f a = v0 - ray.origin, b = v1 - ray.origin, c = v2 - ray.origin;
+    const float ax = a[ray.kx] - ray.sx * a[ray.kz], ay = a[ray.ky] - ray.sy * a[ray.kz];
+    const float bx = b[ray.kx] - ray.sx * b[ray.kz], by = b[ray.ky] - ray.sy * b[ray.kz];
+    const float cx = c[ray.kx] - ray.sx * c[ray.kz], cy = c[ray.ky] - ray.sy * c[ray.kz];
+    float u = cx * by - cy * bx, v = ax * cy - ay * cx, w = bx * ay - by * ax;
+    // exactly on an edge in single precision, the double products settle which side it is
+    if (u == 0 || v == 0 || w == 0) {
+        u = float(double(cx) * by - double(cy) * bx);
+        v = float(double(ax) * cy - double(ay) * cx);
+        w = float(double(bx) * ay - double(by) * ax);
+    }
+    if ((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0)) return false;
+    const float det = u + v + w;
+    if (det == 0) return false;
+    const float d = u * (ray.sz * a[ray.kz]) + v * (ray.sz * b[ray.kz]) + w * (ray.sz * c[ray.kz]);
+    t_dist = d / det;
+    return t_dist > TRIANGLE_EPSILON;
+}
+
+// up to N triangles of a bvh leaf as structure of arrays, tested against one ray at once. prim is the primitive
+// each slot holds, the first count slots are used and the others are never reported hit, whatever they hold. the
+// vertices rather than the edges are kept so that the watertight test sees the shared ones exactly
+template <int N>
+struct alignas(64) TrianglePack {
+    static constexpr int WIDTH = N;
+    static constexpr float EPSILON = TRIANGLE_EPSILON;
+
+    float v0x[N], v0y[N], v0z[N];
+    float v1x[N], v1y[N], v1z[N];
+    float v2x[N], v2y[N], v2z[N];
+    uint32_t prim[N];
+    uint32_t count;
+
+    // fills the slots in order, slot i makes the first i+1 used
+    void set(const int i, const vec3f& v0, const vec3f& v1, const vec3f& v2, const uint32_t p) {
+        v0x[i] = v0.x; v0y[i] = v0.y; v0z[i] = v0.z;
+        v1x[i] = v1.x; v1y[i] = v1.y; v1z[i] = v1.z;
+        v2x[i] = v2.x; v2y[i] = v2.y; v2z[i] = v2.z;
+        prim[i] = p;
+        count = i + 1;
+    }
+
+    // moller-trumbore on every slot in the same order of operations as Model::ray_intersect, except that t is
+    // divided by the determinant in single precision. returns the slot of the nearest hit closer than t_max and
+    // its distance in t, or -1
+    inline int intersect(const vec3f& origin, const vec3f& direction, const float t_max, float& t) const {
+#if defined(__AVX__)
+        if constexpr (N == 8) {
+            const __m256 dx = _mm256_set1_ps(direction.x), dy = _mm256_set1_ps(direction.y), dz = _mm256_set1_ps(direction.z);
+            const __m256 v0_x = _mm256_load_ps(v0x), v0_y = _mm256_load_ps(v0y), v0_z = _mm256_load_ps(v0z);
+            const __m256 e1_x = _mm256_sub_ps(_mm256_load_ps(v1x), v0_x), e1_y = _mm256_sub_ps(_mm256_load_ps(v1y), v0_y), e1_z = _mm256_sub_ps(_mm256_load_ps(v1z), v0_z);
+            const __m256 e2_x = _mm256_sub_ps(_mm256_load_ps(v2x), v0_x), e2_y = _mm256_sub_ps(_mm256_load_ps(v2y), v0_y), e2_z = _mm256_sub_ps(_mm256_load_ps(v2z), v0_z);
+            const __m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2_z), _mm256_mul_ps(dz, e2_y));
+            const __m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2_x), _mm256_mul_ps(dx, e2_z));
+            const __m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2_y), _mm256_mul_ps(dy, e2_x));
+            const __m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1_z, pz), _mm256_mul_ps(e1_y, py)), _mm256_mul_ps(e1_x, px));
+            const __m256 zero = _mm256_setzero_ps();
+            const __m256 back = _mm256_cmp_ps(det, zero, _CMP_LT_OQ);
+            const __m256 a = _mm256_andnot_ps(_mm256_set1_ps(-0.f), det);
+
+            // flipping tvec for back faces keeps u, v and t in the same scale as a
+            const __m256 ox = _mm256_set1_ps(origin.x), oy = _mm256_set1_ps(origin.y), oz = _mm256_set1_ps(origin.z);
+            const __m256 tx = _mm256_blendv_ps(_mm256_sub_ps(ox, v0_x), _mm256_sub_ps(v0_x, ox), back);
+            const __m256 ty = _mm256_blendv_ps(_mm256_sub_ps(oy, v0_y), _mm256_sub_ps(v0_y, oy), back);
+            const __m256 tz = _mm256_blendv_ps(_mm256_sub_ps(oz, v0_z), _mm256_sub_ps(v0_z, oz), back);
+            const __m256 u = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(tz, pz), _mm256_mul_ps(ty, py)), _mm256_mul_ps(tx, px));
+
+            const __m256 qx = _mm256_sub_ps(_mm256_mul_ps(ty, e1_z), _mm256_mul_ps(tz, e1_y));
+            const __m256 qy = _mm256_sub_ps(_mm256_mul_ps(tz, e1_x), _mm256_mul_ps(tx, e1_z));
+            const __m256 qz = _mm256_sub_ps(_mm256_mul_ps(tx, e1_y), _mm256_mul_ps(ty, e1_x));
+            const __m256 v = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dz, qz), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dx, qx));
+            const __m256 dist = _mm256_div_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2_z, qz), _mm256_mul_ps(e2_y, qy)),
+                _mm256_mul_ps(e2_x, qx)), a);
+
+            __m256 hit = _mm256_and_ps(used(), _mm256_cmp_ps(a, _mm256_set1_ps(EPSILON), _CMP_GE_OQ));
+            hit = _mm256_and_ps(hit, _mm256_and_ps(_mm256_cmp_ps(u, zero, _CMP_GE_OQ), _mm256_cmp_ps(u, a, _CMP_LE_OQ)));
+            hit = _mm256_and_ps(hit, _mm256_and_ps(_mm256_cmp_ps(v, zero, _CMP_GE_OQ), _mm256_cmp_ps(_mm256_add_ps(u, v), a, _CMP_LE_OQ)));
+            hit = _mm256_and_ps(hit, _mm256_and_ps(_mm256_cmp_ps(dist, _mm256_set1_ps(EPSILON), _CMP_GT_OQ),
+                _mm256_cmp_ps(dist, _mm256_set1_ps(t_max), _CMP_LT_OQ)));
+            return nearest(hit, dist, t);
+        }
+#endif
+#if defined(__SSE4_1__)
+        if constexpr (N == 4) {
+            const __m128 dx = _mm_set1_ps(direction.x), dy = _mm_set1_ps(direction.y), dz = _mm_set1_ps(direction.z);
+            const __m128 v0_x = _mm_load_ps(v0x), v0_y = _mm_load_ps(v0y), v0_z = _mm_load_ps(v0z);
+            const __m128 e1_x = _mm_sub_ps(_mm_load_ps(v1x), v0_x), e1_y = _mm_sub_ps(_mm_load_ps(v1y), v0_y), e1_z = _mm_sub_ps(_mm_load_ps(v1z), v0_z);
+            const __m128 e2_x = _mm_sub_ps(_mm_load_ps(v2x), v0_x), e2_y = _mm_sub_ps(_mm_load_ps(v2y), v0_y), e2_z = _mm_sub_ps(_mm_load_ps(v2z), v0_z);
+            const __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2_z), _mm_mul_ps(dz, e2_y));
+            const __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2_x), _mm_mul_ps(dx, e2_z));
+            const __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2_y), _mm_mul_ps(dy, e2_x));
+            const __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1_z, pz), _mm_mul_ps(e1_y, py)), _mm_mul_ps(e1_x, px));
+            const __m128 zero = _mm_setzero_ps();
+            const __m128 back = _mm_cmplt_ps(det, zero);
+            const __m128 a = _mm_andnot_ps(_mm_set1_ps(-0.f), det);
+
+            const __m128 ox = _mm_set1_ps(origin.x), oy = _mm_set1_ps(origin.y), oz = _mm_set1_ps(origin.z);
+            const __m128 tx = _mm_blendv_ps(_mm_sub_ps(ox, v0_x), _mm_sub_ps(v0_x, ox), back);
+            const __m128 ty = _mm_blendv_ps(_mm_sub_ps(oy, v0_y), _mm_sub_ps(v0_y, oy), back);
+            const __m128 tz = _mm_blendv_ps(_mm_sub_ps(oz, v0_z), _mm_sub_ps(v0_z, oz), back);
+            const __m128 u = _mm_add_ps(_mm_add_ps(_mm_mul_ps(tz, pz), _mm_mul_ps(ty, py)), _mm_mul_ps(tx, px));
+
+            const __m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1_z), _mm_mul_ps(tz, e1_y));
+            const __m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1_x), _mm_mul_ps(tx, e1_z));
+            const __m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1_y), _mm_mul_ps(ty, e1_x));
+            const __m128 v = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dz, qz), _mm_mul_ps(dy, qy)), _mm_mul_ps(dx, qx));
+            const __m128 dist = _mm_div_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2_z, qz), _mm_mul_ps(e2_y, qy)), _mm_mul_ps(e2_x, qx)), a);
+
+            __m128 hit = _mm_and_ps(used(), _mm_cmpge_ps(a, _mm_set1_ps(EPSILON)));
+            hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmple_ps(u, a)));
+            hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpge_ps(v, zero), _mm_cmple_ps(_mm_add_ps(u, v), a)));
+            hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpgt_ps(dist, _mm_set1_ps(EPSILON)), _mm_cmplt_ps(dist, _mm_set1_ps(t_max))));
+            return nearest(hit, dist, t);
+        }
+#endif
+        int nearest = -1;
+        for (int i = 0; i < int(count); ++i) {
+            const vec3f v0 = vertex(0, i), e1 = vertex(1, i) - v0, e2 = vertex(2, i) - v0;
+            const vec3f pvec = cross(direction, e2);
+            const float det = e1 * pvec;
+            const float a = std::abs(det);
+            if (a < EPSILON) continue;
+            const vec3f tvec = det < 0 ? v0 - origin : origin - v0;
+            const float u = tvec * pvec;
+            if (u < 0 || u > a) continue;
+            const vec3f qvec = cross(tvec, e1);
+            const float v = direction * qvec;
+            if (v < 0 || u + v > a) continue;
+            const float dist = e2 * qvec / a;
+            if (dist > EPSILON && dist < (nearest < 0 ? t_max : t)) {
+                t = dist;
+                nearest = i;
+            }
+        }
+        return nearest;
+    }
+
+    // the watertight test on every slot, same results as ray_intersect_watertight but for the rare hits exactly on
+    // an edge, which are settled in single precision here
+    NO_FP_CONTRACT inline int intersect(const WatertightRay& ray, const float t_max, float& t) const {
+        NO_FP_CONTRACT_BODY
+        const float* const vx[3][3] = {{v0x, v0y, v0z}, {v1x, v1y, v1z}, {v2x, v2y, v2z}};
+#if defined(__AVX__)
+        if constexpr (N == 8) {
+            const __m256 sx = _mm256_set1_ps(ray.sx), sy = _mm256_set1_ps(ray.sy), sz = _mm256_set1_ps(ray.sz);
+            const __m256 ox = _mm256_set1_ps(ray.origin[ray.kx]), oy = _mm256_set1_ps(ray.origin[ray.ky]), oz = _mm256_set1_ps(ray.origin[ray.kz]);
+            __m256 x[3], y[3], z[3];
+            for (int k = 0; k < 3; ++k) {
+                z[k] = _mm256_sub_ps(_mm256_load_ps(vx[k][ray.kz]), oz);
+                x[k] = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(vx[k][ray.kx]), ox), _mm256_mul_ps(sx, z[k]));
+                y[k] = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(vx[k][ray.ky]), oy), _mm256_mul_ps(sy, z[k]));
+            }
+            const __m256 u = _mm256_sub_ps(_mm256_mul_ps(x[2], y[1]), _mm256_mul_ps(y[2], x[1]));
+            const __m256 v = _mm256_sub_ps(_mm256_mul_ps(x[0], y[2]), _mm256_mul_ps(y[0], x[2]));
+            const __m256 w = _mm256_sub_ps(_mm256_mul_ps(x[1], y[0]), _mm256_mul_ps(y[1], x[0]));
+            const __m256 zero = _mm256_setzero_ps();
+            const __m256 any_negative = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(u, zero, _CMP_LT_OQ), _mm256_cmp_ps(v, zero, _CMP_LT_OQ)),
+                _mm256_cmp_ps(w, zero, _CMP_LT_OQ));
+            const __m256 any_positive = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(u, zero, _CMP_GT_OQ), _mm256_cmp_ps(v, zero, _CMP_GT_OQ)),
+                _mm256_cmp_ps(w, zero, _CMP_GT_OQ));
+            const __m256 det = _mm256_add_ps(_mm256_add_ps(u, v), w);
+            const __m256 d = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(u, _mm256_mul_ps(sz, z[0])), _mm256_mul_ps(v, _mm256_mul_ps(sz, z[1]))),
+                _mm256_mul_ps(w, _mm256_mul_ps(sz, z[2])));
+            const __m256 dist = _mm256_div_ps(d, det);
+            __m256 hit = _mm256_andnot_ps(_mm256_and_ps(any_negative, any_positive), _mm256_and_ps(used(), _mm256_cmp_ps(det, zero, _CMP_NEQ_OQ)));
+            hit = _mm256_and_ps(hit, _mm256_and_ps(_mm256_cmp_ps(dist, _mm256_set1_ps(EPSILON), _CMP_GT_OQ),
+                _mm256_cmp_ps(dist, _mm256_set1_ps(t_max), _CMP_LT_OQ)));
+            return nearest(hit, dist, t);
+        }
+#endif
+#if defined(__SSE4_1__)
+        if constexpr (N == 4) {
+            const __m128 sx = _mm_set1_ps(ray.sx), sy = _mm_set1_ps(ray.sy), sz = _mm_set1_ps(ray.sz);
+            const __m128 ox = _mm_set1_ps(ray.origin[ray.kx]), oy = _mm_set1_ps(ray.origin[ray.ky]), oz = _mm_set1_ps(ray.origin[ray.kz]);
+            __m128 x[3], y[3], z[3];
+            for (int k = 0; k < 3; ++k) {
+                z[k] = _mm_sub_ps(_mm_load_ps(vx[k][ray.kz]), oz);
+                x[k] = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(vx[k][ray.kx]), ox), _mm_mul_ps(sx, z[k]));
+                y[k] = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(vx[k][ray.ky]), oy), _mm_mul_ps(sy, z[k]));
+            }
+            const __m128 u = _mm_sub_ps(_mm_mul_ps(x[2], y[1]), _mm_mul_ps(y[2], x[1]));
+            const __m128 v = _mm_sub_ps(_mm_mul_ps(x[0], y[2]), _mm_mul_ps(y[0], x[2]));
+            const __m128 w = _mm_sub_ps(_mm_mul_ps(x[1], y[0]), _mm_mul_ps(y[1], x[0]));
+            const __m128 zero = _mm_setzero_ps();
+            const __m128 any_negative = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(u, zero), _mm_cmplt_ps(v, zero)), _mm_cmplt_ps(w, zero));
+            const __m128 any_positive = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(u, zero), _mm_cmpgt_ps(v, zero)), _mm_cmpgt_ps(w, zero));
+            const __m128 det = _mm_add_ps(_mm_add_ps(u, v), w);
+            const __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(u, _mm_mul_ps(sz, z[0])), _mm_mul_ps(v, _mm_mul_ps(sz, z[1]))),
+                _mm_mul_ps(w, _mm_mul_ps(sz, z[2])));
+            const __m128 dist = _mm_div_ps(d, det);
+            __m128 hit = _mm_andnot_ps(_mm_and_ps(any_negative, any_positive), _mm_and_ps(used(), _mm_cmpneq_ps(det, zero)));
+            hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpgt_ps(dist, _mm_set1_ps(EPSILON)), _mm_cmplt_ps(dist, _mm_set1_ps(t_max))));
+            return nearest(hit, dist, t);
+        }
+#endif
+        int nearest = -1;
+        for (int i = 0; i < int(count); ++i) {
+            float dist;
+            if (ray_intersect_watertight(ray, vertex(0, i), vertex(1, i), vertex(2, i), dist) && dist < (nearest < 0 ? t_max : t)) {
+                t = dist;
+                nearest = i;
+            }
+        }
+        return nearest;
+    }
+
+private:
+    inline vec3f vertex(const int k, const int i) const {
+        return k == 0 ? vec3f(v0x[i], v0y[i], v0z[i]) : k == 1 ? vec3f(v1x[i], v1y[i], v1z[i]) : vec3f(v2x[i], v2y[i], v2z[i]);
+    }
+
+    // all ones in the lanes of the used slots
+#if defined(__AVX__)
+    inline __m256 used() const requires (N == 8) {
+        return _mm256_cmp_ps(_mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_ps(float(count)), _CMP_LT_OQ);
+    }
+#endif
+#if defined(__SSE4_1__)
+    inline __m128 used() const requires (N == 4) {
+        return _mm_cmplt_ps(_mm_setr_ps(0, 1, 2, 3), _mm_set1_ps(float(count)));
+    }
+#endif
+
+    // the slot of the smallest distance among the hit ones, through a horizontal min where the others hold +inf
+#if defined(__AVX__)
+    static inline int nearest(const __m256 hit, const __m256 dist, float& t) {
+        if (_mm256_testz_ps(hit, hit)) return -1;
+        const __m256 masked = _mm256_blendv_ps(_mm256_set1_ps(std::numeric_limits<float>::infinity()), dist, hit);
+        __m256 m = _mm256_min_ps(masked, _mm256_permute2f128_ps(masked, masked, 1));
+        m = _mm256_min_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+        m = _mm256_min_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+        t = _mm256_cvtss_f32(m);
+        return std::countr_zero(unsigned(_mm256_movemask_ps(_mm256_and_ps(hit, _mm256_cmp_ps(dist, m, _CMP_EQ_OQ)))));
+    }
+#endif
+#if defined(__SSE4_1__)
+    static inline int nearest(const __m128 hit, const __m128 dist, float& t) {
+        if (!_mm_movemask_ps(hit)) return -1;
+        const __m128 masked = _mm_blendv_ps(_mm_set1_ps(std::numeric_limits<float>::infinity()), dist, hit);
+        __m128 m = _mm_min_ps(masked, _mm_shuffle_ps(masked, masked, _MM_SHUFFLE(1, 0, 3, 2)));
+        m = _mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+        t = _mm_cvtss_f32(m);
+        return std::countr_zero(unsigned(_mm_movemask_ps(_mm_and_ps(hit, _mm_cmpeq_ps(dist, m)))));
+    }
+#endif
+};
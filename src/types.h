@@ -24,7 +24,7 @@ template <typename T>
 struct vec<2,T> {
     vec() : x(T()), y(T()) {}
     vec(T X, T Y) : x(X), y(Y) {}
-    template <class U> vec<2,T>(const vec<2,U> &v);
+    template <class U> vec(const vec<2,U> &v);
           T& operator[](const size_t i)       { assert(i<2); return i<=0 ? x : y; }
     const T& operator[](const size_t i) const { assert(i<2); return i<=0 ? x : y; }
     T x,y;
@@ -92,4 +92,77 @@ std::ostream& operator<<(std::ostream& out, const vec<DIM,T>& v) {
         out << v[i] << " " ;
     }
     return out ;
-}
\ No newline at end of file
+}
+
+// affine transform: the 3x3 linear part in the first three columns and the translation in the last one
+struct mat3x4 {
+    vec4f rows[3] = {vec4f(1,0,0,0), vec4f(0,1,0,0), vec4f(0,0,1,0)};
+
+    static mat3x4 translation(const vec3f& t) {
+        mat3x4 m;
+        m.rows[0].w = t.x; m.rows[1].w = t.y; m.rows[2].w = t.z;
+        return m;
+    }
+
+    static mat3x4 scale(const float s) {
+        mat3x4 m;
+        m.rows[0].x = m.rows[1].y = m.rows[2].z = s;
+        return m;
+    }
+
+    static mat3x4 rotation_y(const float angle) {
+        mat3x4 m;
+        const float c = std::cos(angle), s = std::sin(angle);
+        m.rows[0] = vec4f( c, 0, s, 0);
+        m.rows[2] = vec4f(-s, 0, c, 0);
+        return m;
+    }
+
+    vec3f transform_point(const vec3f& p) const {
+        return vec3f(rows[0].x*p.x + rows[0].y*p.y + rows[0].z*p.z + rows[0].w,
+                     rows[1].x*p.x + rows[1].y*p.y + rows[1].z*p.z + rows[1].w,
+                     rows[2].x*p.x + rows[2].y*p.y + rows[2].z*p.z + rows[2].w);
+    }
+
+    vec3f transform_vector(const vec3f& v) const {
+        return vec3f(rows[0].x*v.x + rows[0].y*v.y + rows[0].z*v.z,
+                     rows[1].x*v.x + rows[1].y*v.y + rows[1].z*v.z,
+                     rows[2].x*v.x + rows[2].y*v.y + rows[2].z*v.z);
+    }
+
+    // multiplies by the transposed linear part, called on the inverse transform this maps normals
+    vec3f transpose_transform_vector(const vec3f& v) const {
+        return vec3f(rows[0].x*v.x + rows[1].x*v.y + rows[2].x*v.z,
+                     rows[0].y*v.x + rows[1].y*v.y + rows[2].y*v.z,
+                     rows[0].z*v.x + rows[1].z*v.y + rows[2].z*v.z);
+    }
+
+    mat3x4 operator*(const mat3x4& rhs) const {
+        mat3x4 m;
+        for (int i = 0; i < 3; ++i) {
+            for (int j = 0; j < 4; ++j) {
+                float sum = j == 3 ? rows[i].w : 0.f;
+                for (int k = 0; k < 3; ++k) sum += rows[i][k] * rhs.rows[k][j];
+                m.rows[i][j] = sum;
+            }
+        }
+        return m;
+    }
+
+    mat3x4 inverse() const {
+        const vec4f& a = rows[0];
+        const vec4f& b = rows[1];
+        const vec4f& c = rows[2];
+        const float det = a.x*(b.y*c.z - b.z*c.y) - a.y*(b.x*c.z - b.z*c.x) + a.z*(b.x*c.y - b.y*c.x);
+        assert(std::fabs(det) > 0);
+        const float inv_det = 1.f / det;
+
+        mat3x4 m;
+        m.rows[0] = vec4f((b.y*c.z - b.z*c.y)*inv_det, (a.z*c.y - a.y*c.z)*inv_det, (a.y*b.z - a.z*b.y)*inv_det, 0);
+        m.rows[1] = vec4f((b.z*c.x - b.x*c.z)*inv_det, (a.x*c.z - a.z*c.x)*inv_det, (a.z*b.x - a.x*b.z)*inv_det, 0);
+        m.rows[2] = vec4f((b.x*c.y - b.y*c.x)*inv_det, (a.y*c.x - a.x*c.y)*inv_det, (a.x*b.y - a.y*b.x)*inv_det, 0);
+        const vec3f t = m.transform_vector(vec3f(a.w, b.w, c.w));
+        m.rows[0].w = -t.x; m.rows[1].w = -t.y; m.rows[2].w = -t.z;
+        return m;
+    }
+};
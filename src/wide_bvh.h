@@ -0,0 +1,538 @@
+#pragma once
+
+#include <bit>
+#include <cmath>
+#include <span>
+#include <vector>
+#include <limits>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <algorithm>
+
+#if defined(__AVX__) || defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
+
+#include "types.h"
+#include "bvh.h"
+
+enum class BVHLayout { Binary, Wide, Quantized };
+
+#if defined(__AVX__)
+constexpr int WIDE_BVH_WIDTH = 8;
+#else
+constexpr int WIDE_BVH_WIDTH = 4;
+#endif
+
+// N children per node with their bounds stored as structure of arrays, so one ray is tested against
+// all of them at once. unused slots have all bounds at +inf, which every slab test rejects
+template <int N>
+struct alignas(64) WideBVHNode {
+    static constexpr int WIDTH = N;
+
+    float min_x[N], min_y[N], min_z[N];
+    float max_x[N], max_y[N], max_z[N];
+    uint32_t child[N]; // wide node index for interior children, first primitive for leaves
+    uint32_t count[N]; // number of primitives for leaves, 0 for interior children
+
+    void set_bounds(const int n, const AABB* bounds) {
+        constexpr float inf = std::numeric_limits<float>::infinity();
+        for (int i = 0; i < N; ++i) {
+            const AABB b = i < n ? bounds[i] : AABB{vec3f(inf, inf, inf), vec3f(inf, inf, inf)};
+            min_x[i] = b.min.x; min_y[i] = b.min.y; min_z[i] = b.min.z;
+            max_x[i] = b.max.x; max_y[i] = b.max.y; max_z[i] = b.max.z;
+            child[i] = 0;
+            count[i] = 0;
+        }
+    }
+
+    inline bool used(const int i) const { return min_x[i] != std::numeric_limits<float>::infinity(); }
+
+    // whether no ray can enter slot i, the packet traversal goes by used() alone but the slab test only misses a
+    // slot with every bound at +inf
+    inline bool empty(const int i) const {
+        constexpr float inf = std::numeric_limits<float>::infinity();
+        return min_x[i] == inf && min_y[i] == inf && min_z[i] == inf && max_x[i] == inf && max_y[i] == inf && max_z[i] == inf;
+    }
+
+    inline AABB bounds(const int i) const {
+        return {vec3f(min_x[i], min_y[i], min_z[i]), vec3f(max_x[i], max_y[i], max_z[i])};
+    }
+
+    // slab test of the ray against every child, returns a bitmask of the hit ones and their entry distances
+    inline int intersect(const vec3f& origin, const vec3f& inv_dir, const float t_max, float* dist) const {
+#if defined(__AVX__)
+        if constexpr (N == 8) {
+            const __m256 ox = _mm256_set1_ps(origin.x), oy = _mm256_set1_ps(origin.y), oz = _mm256_set1_ps(origin.z);
+            const __m256 ix = _mm256_set1_ps(inv_dir.x), iy = _mm256_set1_ps(inv_dir.y), iz = _mm256_set1_ps(inv_dir.z);
+            const __m256 tx0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(min_x), ox), ix);
+            const __m256 tx1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(max_x), ox), ix);
+            const __m256 ty0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(min_y), oy), iy);
+            const __m256 ty1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(max_y), oy), iy);
+            const __m256 tz0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(min_z), oz), iz);
+            const __m256 tz1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(max_z), oz), iz);
+            const __m256 t_near = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(tx0, tx1), _mm256_min_ps(ty0, ty1)),
+                _mm256_max_ps(_mm256_min_ps(tz0, tz1), _mm256_setzero_ps()));
+            const __m256 t_far = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(tx0, tx1), _mm256_max_ps(ty0, ty1)),
+                _mm256_min_ps(_mm256_max_ps(tz0, tz1), _mm256_set1_ps(t_max)));
+            _mm256_store_ps(dist, t_near);
+            return _mm256_movemask_ps(_mm256_cmp_ps(t_near, t_far, _CMP_LE_OQ));
+        }
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+        if constexpr (N == 4) {
+            const __m128 ox = _mm_set1_ps(origin.x), oy = _mm_set1_ps(origin.y), oz = _mm_set1_ps(origin.z);
+            const __m128 ix = _mm_set1_ps(inv_dir.x), iy = _mm_set1_ps(inv_dir.y), iz = _mm_set1_ps(inv_dir.z);
+            const __m128 tx0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(min_x), ox), ix);
+            const __m128 tx1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(max_x), ox), ix);
+            const __m128 ty0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(min_y), oy), iy);
+            const __m128 ty1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(max_y), oy), iy);
+            const __m128 tz0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(min_z), oz), iz);
+            const __m128 tz1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(max_z), oz), iz);
+            const __m128 t_near = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx0, tx1), _mm_min_ps(ty0, ty1)),
+                _mm_max_ps(_mm_min_ps(tz0, tz1), _mm_setzero_ps()));
+            const __m128 t_far = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx0, tx1), _mm_max_ps(ty0, ty1)),
+                _mm_min_ps(_mm_max_ps(tz0, tz1), _mm_set1_ps(t_max)));
+            _mm_store_ps(dist, t_near);
+            return _mm_movemask_ps(_mm_cmple_ps(t_near, t_far));
+        }
+#endif
+        int mask = 0;
+        for (int i = 0; i < N; ++i) {
+            const float tx0 = (min_x[i] - origin.x) * inv_dir.x, tx1 = (max_x[i] - origin.x) * inv_dir.x;
+            const float ty0 = (min_y[i] - origin.y) * inv_dir.y, ty1 = (max_y[i] - origin.y) * inv_dir.y;
+            const float tz0 = (min_z[i] - origin.z) * inv_dir.z, tz1 = (max_z[i] - origin.z) * inv_dir.z;
+            const float t_near = std::max(std::max(std::min(tx0, tx1), std::min(ty0, ty1)), std::max(std::min(tz0, tz1), 0.f));
+            const float t_far = std::min(std::min(std::max(tx0, tx1), std::max(ty0, ty1)), std::min(std::max(tz0, tz1), t_max));
+            dist[i] = t_near;
+            mask |= (t_near <= t_far) << i;
+        }
+        return mask;
+    }
+};
+
+// 2^e for the exponent range of normal floats
+inline float exp2i(const int e) {
+    return std::bit_cast<float>(uint32_t(e + 127) << 23);
+}
+
+// compressed wide node: child bounds are 8-bit offsets on a power of two grid anchored at the node's
+// lower corner, rounded outwards so the decoded boxes always contain the real ones.
+// 64 bytes for N=4 and 112 bytes for N=8, against 128 and 256 for WideBVHNode
+template <int N>
+struct alignas(16) QuantizedBVHNode {
+    static constexpr int WIDTH = N;
+
+    float origin[3];
+    int8_t exponent[3]; // grid spacing per axis is 2^exponent
+    uint8_t valid;      // bitmask of the used child slots
+    uint8_t qmin_x[N], qmin_y[N], qmin_z[N];
+    uint8_t qmax_x[N], qmax_y[N], qmax_z[N];
+    uint16_t count[N];  // number of primitives for leaves, 0 for interior children. larger leaves are split
+    uint32_t child[N];  // wide node index for interior children, first primitive for leaves
+
+    void set_bounds(const int n, const AABB* bounds) {
+        AABB parent;
+        for (int i = 0; i < n; ++i) parent.grow(bounds[i]);
+
+        uint8_t* qmin[3] = {qmin_x, qmin_y, qmin_z};
+        uint8_t* qmax[3] = {qmax_x, qmax_y, qmax_z};
+        for (int axis = 0; axis < 3; ++axis) {
+            origin[axis] = parent.min[axis];
+            const float extent = parent.max[axis] - parent.min[axis];
+            int e = extent > 0 ? int(std::ceil(std::log2(extent / 255.f))) : -126;
+            while (e < 127 && std::ldexp(255.f, e) + origin[axis] < parent.max[axis]) ++e;
+            exponent[axis] = int8_t(std::clamp(e, -126, 127));
+            const float scale = exp2i(exponent[axis]);
+
+            for (int i = 0; i < N; ++i) {
+                if (i >= n) {
+                    qmin[axis][i] = qmax[axis][i] = 0;
+                    continue;
+                }
+                int lo = std::clamp(int(std::floor((bounds[i].min[axis] - origin[axis]) / scale)), 0, 255);
+                int hi = std::clamp(int(std::ceil((bounds[i].max[axis] - origin[axis]) / scale)), 0, 255);
+                while (lo > 0 && origin[axis] + lo * scale > bounds[i].min[axis]) --lo;
+                while (hi < 255 && origin[axis] + hi * scale < bounds[i].max[axis]) ++hi;
+                qmin[axis][i] = lo;
+                qmax[axis][i] = hi;
+            }
+        }
+
+        valid = uint8_t((1u << n) - 1);
+        for (int i = 0; i < N; ++i) {
+            child[i] = 0;
+            count[i] = 0;
+        }
+    }
+
+    inline bool used(const int i) const { return valid >> i & 1; }
+    inline bool empty(const int i) const { return !used(i); } // the slab test masks the unused slots out
+
+    // the decoded bounds of child i, which contain the real ones as the grid does
+    inline AABB bounds(const int i) const {
+        const float ex = exp2i(exponent[0]), ey = exp2i(exponent[1]), ez = exp2i(exponent[2]);
+        return {vec3f(origin[0] + qmin_x[i] * ex, origin[1] + qmin_y[i] * ey, origin[2] + qmin_z[i] * ez),
+                vec3f(origin[0] + qmax_x[i] * ex, origin[1] + qmax_y[i] * ey, origin[2] + qmax_z[i] * ez)};
+    }
+
+    // slab test of the ray against every child, on the child planes q * 2^e + origin. those are decoded before
+    // the multiplication by inv_dir rather than folded into q * (2^e / d) + (origin - o) / d: a ray parallel to an
+    // axis has an infinite inv_dir there, and 0 * inf would turn the slab into nan. q * 2^e is exact, so the
+    // decoding rounds only once and an fma gives the same planes as a multiply and an add
+    inline int intersect(const vec3f& o, const vec3f& inv_dir, const float t_max, float* dist) const {
+#if defined(__AVX2__)
+        if constexpr (N == 8) {
+            auto slab = [&](const uint8_t* q, const int axis) {
+                const __m256 plane = _mm256_fmadd_ps(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(q)))),
+                    _mm256_set1_ps(exp2i(exponent[axis])), _mm256_set1_ps(origin[axis]));
+                return _mm256_mul_ps(_mm256_sub_ps(plane, _mm256_set1_ps(o[axis])), _mm256_set1_ps(inv_dir[axis]));
+            };
+            const __m256 tx0 = slab(qmin_x, 0), tx1 = slab(qmax_x, 0);
+            const __m256 ty0 = slab(qmin_y, 1), ty1 = slab(qmax_y, 1);
+            const __m256 tz0 = slab(qmin_z, 2), tz1 = slab(qmax_z, 2);
+            const __m256 t_near = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(tx0, tx1), _mm256_min_ps(ty0, ty1)),
+                _mm256_max_ps(_mm256_min_ps(tz0, tz1), _mm256_setzero_ps()));
+            const __m256 t_far = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(tx0, tx1), _mm256_max_ps(ty0, ty1)),
+                _mm256_min_ps(_mm256_max_ps(tz0, tz1), _mm256_set1_ps(t_max)));
+            _mm256_store_ps(dist, t_near);
+            return _mm256_movemask_ps(_mm256_cmp_ps(t_near, t_far, _CMP_LE_OQ)) & valid;
+        }
+#endif
+#if defined(__SSE4_1__)
+        if constexpr (N == 4) {
+            auto slab = [&](const uint8_t* q, const int axis) {
+                int32_t packed;
+                std::memcpy(&packed, q, sizeof(packed));
+                const __m128 plane = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(packed))),
+                    _mm_set1_ps(exp2i(exponent[axis]))), _mm_set1_ps(origin[axis]));
+                return _mm_mul_ps(_mm_sub_ps(plane, _mm_set1_ps(o[axis])), _mm_set1_ps(inv_dir[axis]));
+            };
+            const __m128 tx0 = slab(qmin_x, 0), tx1 = slab(qmax_x, 0);
+            const __m128 ty0 = slab(qmin_y, 1), ty1 = slab(qmax_y, 1);
+            const __m128 tz0 = slab(qmin_z, 2), tz1 = slab(qmax_z, 2);
+            const __m128 t_near = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx0, tx1), _mm_min_ps(ty0, ty1)),
+                _mm_max_ps(_mm_min_ps(tz0, tz1), _mm_setzero_ps()));
+            const __m128 t_far = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx0, tx1), _mm_max_ps(ty0, ty1)),
+                _mm_min_ps(_mm_max_ps(tz0, tz1), _mm_set1_ps(t_max)));
+            _mm_store_ps(dist, t_near);
+            return _mm_movemask_ps(_mm_cmple_ps(t_near, t_far)) & valid;
+        }
+#endif
+        const float ex = exp2i(exponent[0]), ey = exp2i(exponent[1]), ez = exp2i(exponent[2]);
+        int mask = 0;
+        for (int i = 0; i < N; ++i) {
+            const float tx0 = (origin[0] + qmin_x[i] * ex - o.x) * inv_dir.x, tx1 = (origin[0] + qmax_x[i] * ex - o.x) * inv_dir.x;
+            const float ty0 = (origin[1] + qmin_y[i] * ey - o.y) * inv_dir.y, ty1 = (origin[1] + qmax_y[i] * ey - o.y) * inv_dir.y;
+            const float tz0 = (origin[2] + qmin_z[i] * ez - o.z) * inv_dir.z, tz1 = (origin[2] + qmax_z[i] * ez - o.z) * inv_dir.z;
+            const float t_near = std::max(std::max(std::min(tx0, tx1), std::min(ty0, ty1)), std::max(std::min(tz0, tz1), 0.f));
+            const float t_far = std::min(std::min(std::max(tx0, tx1), std::max(ty0, ty1)), std::min(std::max(tz0, tz1), t_max));
+            dist[i] = t_near;
+            mask |= (t_near <= t_far) << i;
+        }
+        return mask & valid;
+    }
+};
+
+// bvh collapsed from a binary one, keeping the same leaves. Node is WideBVHNode or QuantizedBVHNode
+template <typename Node>
+struct WideBVH {
+    static constexpr int N = Node::WIDTH;
+
+    // views and their stores as in BVH
+    std::span<const Node> nodes = {};
+    std::span<const uint32_t> prim_indices = {};
+    std::vector<Node> node_store = {};
+    std::vector<uint32_t> prim_store = {};
+
+    WideBVH() = default;
+    WideBVH(const WideBVH&) = delete;
+    WideBVH& operator=(const WideBVH&) = delete;
+    WideBVH(WideBVH&&) = default;
+    WideBVH& operator=(WideBVH&&) = default;
+
+    void build(const BVH& bvh) {
+        clear();
+        prim_store.assign(bvh.prim_indices.begin(), bvh.prim_indices.end());
+        prim_indices = prim_store;
+        if (bvh.nodes.empty()) return;
+        node_store.reserve(bvh.nodes.size() / (N - 1) + 1);
+        collapse(bvh, 0);
+        nodes = node_store;
+    }
+
+    void view(const std::span<const Node> n, const std::span<const uint32_t> p) {
+        clear();
+        nodes = n;
+        prim_indices = p;
+    }
+
+    void clear() {
+        nodes = {};
+        prim_indices = {};
+        node_store = {};
+        prim_store = {};
+    }
+
+    // same as BVH::valid, checking every slot that a ray can enter
+    bool valid(const uint32_t prim_count) const {
+        for (const uint32_t p : prim_indices) if (p >= prim_count) return false;
+        std::vector<uint8_t> depth(nodes.size());
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            const Node& node = nodes[i];
+            for (int c = 0; c < N; ++c) {
+                if (node.empty(c)) continue;
+                if (node.count[c]) {
+                    if (uint64_t(node.child[c]) + node.count[c] > prim_indices.size()) return false;
+                    continue;
+                }
+                if (node.child[c] <= i || node.child[c] >= nodes.size() || depth[i] + 1 >= BVH::MAX_DEPTH) return false;
+                depth[node.child[c]] = std::max<uint8_t>(depth[node.child[c]], depth[i] + 1);
+            }
+        }
+        return true;
+    }
+
+    inline size_t memory_bytes() const {
+        return nodes.size() * sizeof(Node) + prim_indices.size() * sizeof(uint32_t);
+    }
+
+    // same contract as BVH::intersect
+    template <typename F>
+    bool intersect(const vec3f& origin, const vec3f& direction, float& t_max, F&& intersect_prim) const {
+        return traverse<false>(origin, direction, t_max, [&](const uint32_t first, const uint32_t count, float& t) {
+            bool hit = false;
+            for (uint32_t i = 0; i < count; ++i) hit |= intersect_prim(prim_indices[first + i], t);
+            return hit;
+        });
+    }
+
+    // same contract as BVH::occluded
+    template <typename F>
+    bool occluded(const vec3f& origin, const vec3f& direction, float t_max, F&& occluded_prim) const {
+        return traverse<true>(origin, direction, t_max, [&](const uint32_t first, const uint32_t count, float t) {
+            for (uint32_t i = 0; i < count; ++i) if (occluded_prim(prim_indices[first + i], t)) return true;
+            return false;
+        });
+    }
+
+    // same contracts as the BVH ones
+    template <typename F>
+    bool intersect_leaves(const vec3f& origin, const vec3f& direction, float& t_max, F&& intersect_leaf) const {
+        return traverse<false>(origin, direction, t_max, intersect_leaf);
+    }
+
+    template <typename F>
+    bool occluded_leaves(const vec3f& origin, const vec3f& direction, float t_max, F&& occluded_leaf) const {
+        return traverse<true>(origin, direction, t_max, occluded_leaf);
+    }
+
+    template <typename F>
+    void for_each_leaf(F&& f) const {
+        for (const Node& node : nodes)
+            for (int i = 0; i < N; ++i) if (node.count[i]) f(node.child[i], node.count[i]);
+    }
+
+    // same contracts as the BVH ones, the packet traversal below
+    template <typename F>
+    uint32_t intersect_packet(const RayPacket& packet, const uint32_t active, float* t_max, F&& intersect_leaf) const {
+        return traverse_packet<false>(packet, active, t_max, intersect_leaf);
+    }
+
+    template <typename F>
+    uint32_t occluded_packet(const RayPacket& packet, const uint32_t active, const float* t_max, F&& occluded_leaf) const {
+        float t[RayPacket::N];
+        std::copy(t_max, t_max + RayPacket::N, t);
+        return traverse_packet<true>(packet, active, t, occluded_leaf);
+    }
+
+private:
+    // from the child slot root, count of a leaf or 0 for a wide node
+    template <bool ANY_HIT, typename F>
+    bool traverse(const vec3f& origin, const vec3f& direction, float& t_max, F&& intersect_leaf,
+                  const uint32_t root = 0, const uint32_t root_count = 0) const {
+        if (nodes.empty()) return false;
+
+        struct Entry {
+            uint32_t child;
+            uint32_t count;
+            float dist;
+        };
+        Entry stack[BVH::MAX_DEPTH * N];
+        int stack_size = 0;
+        stack[stack_size++] = {root, root_count, 0.f};
+
+        const vec3f inv_dir(1.f/direction.x, 1.f/direction.y, 1.f/direction.z);
+        bool hit = false;
+
+        while (stack_size) {
+            const Entry e = stack[--stack_size];
+            if (e.dist > t_max) continue;
+
+            if (e.count) {
+                if (intersect_leaf(e.child, e.count, t_max)) {
+                    if constexpr (ANY_HIT) return true;
+                    hit = true;
+                }
+                continue;
+            }
+
+            const Node& node = nodes[e.child];
+            alignas(32) float dist[N];
+            int mask = node.intersect(origin, inv_dir, t_max, dist);
+
+            // push the hit children far to near so the nearest one is popped first, any hit queries only
+            // need some order, but near first still finds occluders sooner on average
+            const int first = stack_size;
+            while (mask) {
+                const int i = std::countr_zero(unsigned(mask));
+                mask &= mask - 1;
+                Entry c = {node.child[i], node.count[i], dist[i]};
+                int j = stack_size++;
+                for (; j > first && stack[j - 1].dist < c.dist; --j) stack[j] = stack[j - 1];
+                stack[j] = c;
+            }
+        }
+
+        return hit;
+    }
+
+    // BVH's packet traversal over wide nodes: each child inside the frustum is tested against all the lanes at
+    // once and goes on with those that reached the node and hit it
+    template <bool ANY_HIT, typename F>
+    uint32_t traverse_packet(const RayPacket& packet, const uint32_t active, float* t_max, F&& intersect_leaf) const {
+        if (nodes.empty() || !active) return 0;
+        const Frustum frustum(packet, active);
+
+        struct Entry {
+            uint32_t child;
+            uint32_t count;
+            uint32_t lanes;
+        };
+        Entry stack[BVH::MAX_DEPTH * N];
+        int stack_size = 0;
+        stack[stack_size++] = {0, 0, active};
+        uint32_t hit = 0;
+
+        while (stack_size) {
+            const Entry e = stack[--stack_size];
+            const uint32_t lanes = ANY_HIT ? e.lanes & ~hit : e.lanes;
+            if (!lanes) continue;
+
+            if (std::has_single_bit(lanes)) {
+                const int lane = std::countr_zero(lanes);
+                auto single_leaf = [&](const uint32_t first, const uint32_t count, float&) {
+                    return intersect_leaf(first, count, lanes) != 0;
+                };
+                if (traverse<ANY_HIT>(packet.origin(lane), packet.direction(lane), t_max[lane], single_leaf, e.child, e.count))
+                    hit |= lanes;
+                continue;
+            }
+
+            if (e.count) {
+                hit |= intersect_leaf(e.child, e.count, lanes);
+                continue;
+            }
+
+            // pushed far to near, by the entry distance of the first lane to hit each child
+            const Node& node = nodes[e.child];
+            const int first = stack_size;
+            float order[N];
+            for (int i = 0; i < N; ++i) {
+                if (!node.used(i)) continue;
+                const AABB b = node.bounds(i);
+                if (frustum.outside(b.min, b.max)) continue;
+                float t_near[RayPacket::N];
+                const uint32_t reached = packet.intersect(b.min, b.max, t_max, t_near) & lanes;
+                if (!reached) continue;
+                const float dist = t_near[std::countr_zero(reached)];
+                int j = stack_size++;
+                for (; j > first && order[j - 1 - first] < dist; --j) {
+                    stack[j] = stack[j - 1];
+                    order[j - first] = order[j - 1 - first];
+                }
+                stack[j] = {node.child[i], node.count[i], reached};
+                order[j - first] = dist;
+            }
+        }
+        return hit;
+    }
+
+    // pulls grandchildren up into the node, always opening the interior child with the largest surface
+    // area, until it has N children or only leaves left. returns the index of the new wide node
+    uint32_t collapse(const BVH& bvh, const uint32_t binary_idx) {
+        uint32_t children[N];
+        int n = 0;
+        const BVHNode& root = bvh.nodes[binary_idx];
+        if (root.is_leaf()) {
+            children[n++] = binary_idx;
+        } else {
+            children[n++] = root.left_first;
+            children[n++] = root.left_first + 1;
+        }
+
+        while (n < N) {
+            int best = -1;
+            float best_area = -1;
+            for (int i = 0; i < n; ++i) {
+                const BVHNode& c = bvh.nodes[children[i]];
+                if (!c.is_leaf() && c.bounds.area() > best_area) {
+                    best = i;
+                    best_area = c.bounds.area();
+                }
+            }
+            if (best < 0) break;
+            const uint32_t opened = bvh.nodes[children[best]].left_first;
+            children[best] = opened;
+            children[n++] = opened + 1;
+        }
+
+        AABB bounds[N];
+        for (int i = 0; i < n; ++i) bounds[i] = bvh.nodes[children[i]].bounds;
+
+        const uint32_t idx = node_store.size();
+        node_store.emplace_back();
+        node_store[idx].set_bounds(n, bounds);
+        for (int i = 0; i < n; ++i) {
+            const BVHNode& c = bvh.nodes[children[i]];
+            if (c.is_leaf() && c.count > MAX_LEAF_COUNT) {
+                const uint32_t child = split_leaf(c, c.left_first, c.count);
+                node_store[idx].child[i] = child;
+            } else if (c.is_leaf()) {
+                node_store[idx].child[i] = c.left_first;
+                node_store[idx].count[i] = c.count;
+            } else {
+                const uint32_t child = collapse(bvh, children[i]);
+                node_store[idx].child[i] = child;
+            }
+        }
+        return idx;
+    }
+
+    // the largest leaf a child slot can hold, larger ones (from the depth limit or centroids the binary build
+    // can't separate) are spread over a subtree of wide nodes with the leaf's bounds
+    static constexpr uint32_t MAX_LEAF_COUNT = std::numeric_limits<std::remove_extent_t<decltype(Node::count)>>::max();
+
+    uint32_t split_leaf(const BVHNode& leaf, const uint32_t first, const uint32_t count) {
+        const uint32_t part = (count + N - 1) / N;
+        const int n = int((count + part - 1) / part);
+        AABB bounds[N];
+        std::fill(bounds, bounds + n, leaf.bounds);
+
+        const uint32_t idx = node_store.size();
+        node_store.emplace_back();
+        node_store[idx].set_bounds(n, bounds);
+        for (int i = 0; i < n; ++i) {
+            const uint32_t start = first + i * part, size = std::min(part, count - i * part);
+            if (size > MAX_LEAF_COUNT) {
+                const uint32_t child = split_leaf(leaf, start, size);
+                node_store[idx].child[i] = child;
+            } else {
+                node_store[idx].child[i] = start;
+                node_store[idx].count[i] = size;
+            }
+        }
+        return idx;
+    }
+};
@@ -0,0 +1,37 @@
+#include <cmath>
+#include <limits>
+#include <random>
+#include <iostream>
+#include "types.h"
+#include "triangle_pack.h"
+
+// fires random rays at the edge shared by two random triangles, which have to hit at least one of them with the
+// watertight test, alone and in a pack. fails when any ray slipped through either
+int main() {
+    constexpr size_t rays = 1000000;
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> coord(-10.f, 10.f), along(0.f, 1.f);
+    auto point = [&] { return vec3f(coord(rng), coord(rng), coord(rng)); };
+    size_t scalar_misses = 0, pack_misses = 0;
+    for (size_t r = 0; r < rays; ++r) {
+        // c and d on either side of the plane through the edge and the ray origin. they are kept off it, the
+        // slivers a nearly grazing ray sees can lose a hit to the rounding of their other edges, shared or not
+        const vec3f a = point(), b = point(), origin = point();
+        const vec3f n = cross(b - a, origin - a);
+        vec3f c = point();
+        while (std::abs((c - a) * n) < std::sqrt(n * n)) c = point();
+        const vec3f d = c - n * (2 * ((c - a) * n) / (n * n)) + (b - a) * (along(rng) - .5f);
+        const vec3f direction = (a + (b - a) * along(rng) - origin).normalize();
+        const WatertightRay ray(origin, direction);
+
+        float t;
+        if (!ray_intersect_watertight(ray, a, b, c, t) && !ray_intersect_watertight(ray, b, a, d, t)) ++scalar_misses;
+        TrianglePack<TRIANGLE_PACK_WIDTH> pack = {};
+        pack.set(0, a, b, c, 0);
+        pack.set(1, b, a, d, 1);
+        if (pack.intersect(ray, std::numeric_limits<float>::max(), t) < 0) ++pack_misses;
+    }
+    std::cout << "watertight check: " << scalar_misses << " of " << rays << " rays missed both triangles, "
+        << pack_misses << " in a pack" << std::endl;
+    return scalar_misses + pack_misses ? 1 : 0;
+}